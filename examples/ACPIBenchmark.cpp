@@ -0,0 +1,276 @@
+#include <libthinkpad.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventMask;
+using ThinkPad::PowerManagement::ACPIEventCount;
+using ThinkPad::PowerManagement::ACPILatency;
+using ThinkPad::PowerManagement::ACPILatencyStage;
+using ThinkPad::PowerManagement::ACPIMetrics;
+using ThinkPad::PowerManagement::ACPIQueueCounters;
+using ThinkPad::PowerManagement::ACPIStats;
+
+/*
+ * Plays acpid on a local socket and pushes a mix of event lines at an
+ * ACPI instance listening on it:
+ *
+ *     ACPIBenchmark [events per second, 0 for as fast as possible]
+ *                   [seconds] [button:lid:dock:unknown weights]
+ *
+ * The defaults are 10000 events per second for 5 seconds, weighted
+ * 70:10:5:15.
+ */
+
+static const char *buttons[] = {
+    ACPI_BUTTON_VOLUME_UP, ACPI_BUTTON_VOLUME_DOWN, ACPI_BUTTON_BRIGHTNESS_UP,
+    ACPI_BUTTON_BRIGHTNESS_DOWN, ACPI_BUTTON_MUTE, ACPI_BUTTON_MICMUTE, ACPI_BUTTON_THINKVANTAGE
+};
+
+static const char *lids[] = { ACPI_LID_CLOSE, ACPI_LID_OPEN };
+static const char *docks[] = { ACPI_DOCK_EVENT, ACPI_UNDOCK_EVENT };
+static const char *unknowns[] = { "processor LNXCPU:00 00000080 00000001", "ac_adapter ACPI0003:00 00000080 00000000" };
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+static std::atomic<long> handled(0);
+static std::atomic<bool> generating(true);
+
+static uint64_t now(clockid_t clock) {
+    struct timespec time;
+    clock_gettime(clock, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+static int threads() {
+
+    std::ifstream status("/proc/self/status");
+    string line;
+
+    while (std::getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) {
+            return atoi(line.c_str() + 8);
+        }
+    }
+
+    return -1;
+}
+
+/* a weighted mix of the event lines, one weight per kind */
+static string mix(const unsigned int weights[4]) {
+
+    string lines;
+
+    const char **kinds[] = { buttons, lids, docks, unknowns };
+    const size_t sizes[] = { COUNT(buttons), COUNT(lids), COUNT(docks), COUNT(unknowns) };
+
+    for (size_t kind = 0; kind < 4; kind++) {
+        for (unsigned int i = 0; i < weights[kind]; i++) {
+            lines += kinds[kind][i % sizes[kind]];
+            lines += '\n';
+        }
+    }
+
+    return lines;
+}
+
+/* writes lines of the mix at rate lines per second, returns how many */
+static long generate(int client, const string &lines, long rate, double *cpu) {
+
+    std::vector<size_t> starts;
+
+    for (size_t i = 0; i < lines.size(); i = lines.find('\n', i) + 1) {
+        starts.push_back(i);
+    }
+
+    const uint64_t begin = now(CLOCK_MONOTONIC);
+    size_t next = 0;
+    long sent = 0;
+
+    while (generating) {
+
+        /* as many lines as are due by now, one millisecond at most */
+        long due = rate > 0 ? (long) ((now(CLOCK_MONOTONIC) - begin) * rate / 1000000000ull) - sent : 256;
+
+        if (due <= 0) {
+            struct timespec pause = { 0, 100000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        due = std::min(due, rate > 0 ? std::max(rate / 1000, 1L) : 256L);
+
+        string chunk;
+
+        for (long i = 0; i < due; i++) {
+            const size_t start = starts[next];
+            const size_t end = lines.find('\n', start) + 1;
+            chunk.append(lines, start, end - start);
+            next = (next + 1) % starts.size();
+        }
+
+        /* a blocked write is acpid waiting on a slow client */
+        for (size_t written = 0; written < chunk.size(); ) {
+            ssize_t length = write(client, chunk.data() + written, chunk.size() - written);
+            if (length <= 0) {
+                generating = false;
+                break;
+            }
+            written += length;
+        }
+
+        sent += due;
+    }
+
+    *cpu = now(CLOCK_THREAD_CPUTIME_ID) / 1e9;
+
+    return sent;
+}
+
+static ACPILatency merge(const ACPIStats &stats, ACPILatencyStage stage) {
+
+    ACPILatency total;
+    memset(&total, 0, sizeof(ACPILatency));
+
+    for (size_t event = 0; event < ACPIEventCount; event++) {
+
+        const ACPILatency &latency = stats.get((ACPIEvent) event, stage);
+
+        total.count += latency.count;
+        total.sum += latency.sum;
+        total.max = std::max(total.max, latency.max);
+
+        for (size_t bucket = 0; bucket < ACPI_LATENCY_BUCKETS; bucket++) {
+            total.buckets[bucket] += latency.buckets[bucket];
+        }
+    }
+
+    return total;
+}
+
+static void report(const char *name, const ACPILatency &latency) {
+    std::cout << name << ": p50 " << latency.percentile(50) / 1000 << " us, p99 "
+              << latency.percentile(99) / 1000 << " us, p99.9 " << latency.percentile(99.9) / 1000
+              << " us, max " << latency.max / 1000 << " us" << std::endl;
+}
+
+static double cpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+
+    const long rate = argc > 1 ? atol(argv[1]) : 10000;
+    const int seconds = argc > 2 ? atoi(argv[2]) : 5;
+
+    unsigned int weights[4] = { 70, 10, 5, 15 };
+
+    if (argc > 3 && sscanf(argv[3], "%u:%u:%u:%u", &weights[0], &weights[1], &weights[2], &weights[3]) != 4) {
+        std::cerr << "the mix is four weights, button:lid:dock:unknown" << std::endl;
+        return 1;
+    }
+
+    std::ostringstream path;
+    path << "/tmp/libthinkpad-benchmark-" << getpid() << ".socket";
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.str().c_str(), sizeof(addr.sun_path) - 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (server < 0 || bind(server, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 || listen(server, 1) < 0) {
+        std::cerr << "failed to listen on " << path.str() << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    ACPI *acpi = new ACPI();
+
+    acpi->addEventHandler([](ACPIEvent event) {
+        handled++;
+    }, ACPIEventMask().set());
+
+    acpi->enableStats(true);
+    acpi->setAcpidSocket(path.str());
+    acpi->start();
+
+    int client = accept(server, NULL, NULL);
+
+    const string lines = mix(weights);
+    const double cpuBefore = cpuSeconds();
+    const uint64_t begin = now(CLOCK_MONOTONIC);
+
+    long sent = 0;
+    double generatorCpu = 0;
+
+    std::thread generator([&]() { sent = generate(client, lines, rate, &generatorCpu); });
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    const int threadCount = threads() - 2;
+
+    generating = false;
+    generator.join();
+
+    /* wait for the lines still in flight */
+    ACPIMetrics metrics;
+    long received = 0;
+
+    for (int i = 0; i < 2000; i++) {
+
+        metrics = acpi->metrics();
+        received = 0;
+
+        for (size_t event = 0; event < ACPIEventCount; event++) {
+            received += metrics.received[event];
+        }
+
+        if (received >= sent) break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const double elapsed = (now(CLOCK_MONOTONIC) - begin) / 1e9;
+    const double cpu = cpuSeconds() - cpuBefore - generatorCpu;
+
+    std::cout << "sent " << sent << " lines, received " << received << ", handled " << handled << std::endl;
+    std::cout << "sustained " << (long) (received / elapsed) << " events/s" << std::endl;
+
+    if (received > 0) {
+        std::cout << "cost " << (long) (cpu * 1e9 / received) << " ns of CPU per event" << std::endl;
+    }
+
+    std::cout << "library threads " << threadCount << std::endl;
+
+    const ACPIQueueCounters queue = acpi->getQueueCounters();
+    std::cout << "queued " << queue.queued << ", overflowed " << queue.overflowed
+              << ", coalesced " << queue.coalesced << std::endl;
+
+    const ACPIStats stats = acpi->stats();
+    report("receive to handler", merge(stats, ThinkPad::PowerManagement::LATENCY_DELIVERY));
+    report("handler", merge(stats, ThinkPad::PowerManagement::LATENCY_HANDLER));
+
+    delete acpi;
+
+    close(client);
+    close(server);
+    unlink(path.str().c_str());
+
+}
@@ -0,0 +1,174 @@
+#include <libthinkpad.h>
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventCount;
+using ThinkPad::PowerManagement::ACPIMetrics;
+
+/*
+ * Checks that dispatching an event does not allocate. Plays acpid on a
+ * local socket, registers small callables, the kind that fit inside an
+ * ACPICallback, and counts every malloc, calloc and realloc of the
+ * process while a stream of events goes through the listener, the
+ * dispatcher and the handlers:
+ *
+ *     AllocationCheck [events]
+ *
+ * operator new of libstdc++ allocates with malloc, so it is counted as
+ * well. The program exits with 1 if anything was allocated. It needs
+ * glibc for the __libc_ functions the counting ones forward to.
+ */
+
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+}
+
+static std::atomic<bool> counting(false);
+static std::atomic<long> allocations(0);
+
+extern "C" void *malloc(size_t size) {
+    if (counting.load(std::memory_order_relaxed)) allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+#define BATCH 32
+
+static const char *lines[] = {
+    ACPI_LID_CLOSE, ACPI_LID_OPEN, ACPI_POWERBUTTON, ACPI_BUTTON_VOLUME_UP,
+    ACPI_BUTTON_VOLUME_DOWN, ACPI_BUTTON_MUTE, ACPI_BUTTON_THINKVANTAGE,
+    "processor LNXCPU:00 00000080 00000001"
+};
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+static std::atomic<long> handled(0);
+
+static long received(ACPI *acpi) {
+
+    const ACPIMetrics metrics = acpi->metrics();
+
+    long total = 0;
+
+    for (size_t event = 0; event < ACPIEventCount; event++) {
+        total += (long) metrics.received[event];
+    }
+
+    return total;
+}
+
+/* sends events in batches, each waited for until every handler ran */
+static bool send(ACPI *acpi, int client, const string &batch, long batches, long handlers) {
+
+    const long before = received(acpi);
+    const long calls = handled;
+
+    for (long sent = 1; sent <= batches; sent++) {
+
+        if (write(client, batch.data(), batch.size()) != (ssize_t) batch.size()) {
+            std::cerr << "failed to write to the listener: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        while (received(acpi) < before + sent * BATCH || handled < calls + sent * BATCH * handlers) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+
+    const long events = argc > 1 ? atol(argv[1]) : 10000;
+
+    std::ostringstream path;
+    path << "/tmp/libthinkpad-allocations-" << getpid() << ".socket";
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.str().c_str(), sizeof(addr.sun_path) - 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (server < 0 || bind(server, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 || listen(server, 1) < 0) {
+        std::cerr << "failed to listen on " << path.str() << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    ACPI *acpi = new ACPI();
+
+    std::atomic<long> *counter = &handled;
+    long *a = nullptr, *b = nullptr, *c = nullptr;
+
+    /* a pointer, four pointers, and one with the repeat count */
+    acpi->addEventHandler([counter](ACPIEvent event) {
+        (*counter)++;
+    });
+
+    acpi->addEventHandler([counter, a, b, c](ACPIEvent event) {
+        (*counter)++;
+        (void) a; (void) b; (void) c;
+    });
+
+    acpi->addEventHandler([counter](ACPIEvent event, unsigned int repeat) {
+        (*counter)++;
+    }, ThinkPad::PowerManagement::ACPIEventMask().set(), ThinkPad::PowerManagement::DISPATCH_INLINE);
+
+    const long handlers = 3;
+
+    acpi->setAcpidSocket(path.str());
+    acpi->start();
+
+    int client = accept(server, NULL, NULL);
+
+    string batch;
+
+    for (int i = 0; i < BATCH; i++) {
+        batch += lines[i % COUNT(lines)];
+        batch += '\n';
+    }
+
+    /* the first events may grow buffers that are kept from then on */
+    if (!send(acpi, client, batch, 16, handlers)) {
+        return 1;
+    }
+
+    counting = true;
+    const bool sent = send(acpi, client, batch, events / BATCH, handlers);
+    counting = false;
+
+    std::cout << "dispatched " << events / BATCH * BATCH << " events to " << handlers << " handlers, "
+              << allocations << " allocations" << std::endl;
+
+    delete acpi;
+
+    close(client);
+    close(server);
+    unlink(path.str().c_str());
+
+    return sent && allocations == 0 ? 0 : 1;
+
+}
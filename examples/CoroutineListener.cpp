@@ -0,0 +1,75 @@
+#include <libthinkpad.h>
+#include <iostream>
+
+/*
+ * Needs C++20, for example g++ -std=c++20 CoroutineListener.cpp -lthinkpad
+ */
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventMask;
+using ThinkPad::PowerManagement::ACPIEventStream;
+
+/* a coroutine nobody waits for */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return Detached(); }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static Detached waitForLid(ACPI &acpi) {
+
+    ACPIEventMask lid;
+    lid.set(ACPIEvent::LID_CLOSED);
+
+    ACPIEvent event = co_await acpi.next(lid);
+
+    std::cout << "the lid was closed for the first time (" << event << ")" << std::endl;
+}
+
+static Detached listen(ACPI &acpi) {
+
+    ACPIEventStream events(acpi);
+
+    for (;;) {
+
+        ACPIEvent event = co_await events.next();
+
+        switch (event) {
+
+            case ACPIEvent::DOCKED:
+                std::cout << "ThinkPad was docked" << std::endl;
+                break;
+            case ACPIEvent::UNDOCKED:
+                std::cout << "ThinkPad was undocked" << std::endl;
+                break;
+            case ACPIEvent::LID_CLOSED:
+                std::cout << "ThinkPad lid was closed" << std::endl;
+                break;
+            case ACPIEvent::LID_OPENED:
+                std::cout << "ThinkPad lid was opened" << std::endl;
+                break;
+            default:
+                break;
+
+        }
+    }
+}
+
+int main(void) {
+
+    ACPI *acpi = new ACPI();
+
+    waitForLid(*acpi);
+    listen(*acpi);
+
+    acpi->start();
+    acpi->wait();
+
+    delete acpi;
+
+}
@@ -0,0 +1,189 @@
+#include <libthinkpad.h>
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventMask;
+using ThinkPad::PowerManagement::ACPIEventCount;
+using ThinkPad::PowerManagement::ACPIMetrics;
+
+/*
+ * Measures what handlers that did not subscribe to an event cost. Plays
+ * acpid on a local socket and registers 20 handlers, first with every
+ * event in their mask and then with one event each:
+ *
+ *     DispatchBenchmark [events]
+ *
+ * The default is 20000 events, cycling through the lines below. Every
+ * batch is waited for until its handlers ran, so no handler queue
+ * overflows and both runs do the same work apart from the masks. The
+ * waiting makes the wall time mostly wakeups, the CPU time is what the
+ * dispatch costs.
+ */
+
+#define HANDLERS 20
+#define BATCH 32
+
+static const char *lines[] = {
+    ACPI_LID_CLOSE, ACPI_LID_OPEN, ACPI_POWERBUTTON,
+    ACPI_BUTTON_BRIGHTNESS_UP, ACPI_BUTTON_BRIGHTNESS_DOWN, ACPI_BUTTON_VOLUME_UP,
+    ACPI_BUTTON_VOLUME_DOWN, ACPI_BUTTON_MICMUTE, ACPI_BUTTON_MUTE, ACPI_BUTTON_THINKVANTAGE,
+    ACPI_BUTTON_FNF2_LOCK, ACPI_BUTTON_FNF3_BATTERY, ACPI_BUTTON_FNF4_SLEEP, ACPI_BUTTON_FNF5_WLAN,
+    ACPI_BUTTON_FNF7_PROJECTOR, ACPI_BUTTON_FNF12_HIBERNATE,
+    "processor LNXCPU:00 00000080 00000001"
+};
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<long> handled(0);
+
+static double cpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/* the handler calls the received events are worth */
+static long expected(const ACPIMetrics &metrics, const ACPIEventMask *masks) {
+
+    long calls = 0;
+
+    for (size_t event = 0; event < ACPIEventCount; event++) {
+        for (size_t handler = 0; handler < HANDLERS; handler++) {
+            if (masks[handler].test(event)) {
+                calls += (long) metrics.received[event];
+            }
+        }
+    }
+
+    return calls;
+}
+
+static long received(const ACPIMetrics &metrics) {
+
+    long total = 0;
+
+    for (size_t event = 0; event < ACPIEventCount; event++) {
+        total += (long) metrics.received[event];
+    }
+
+    return total;
+}
+
+/* one run over a fresh instance, returns the CPU microseconds per event */
+static double run(const string &path, int server, long events, bool masked) {
+
+    ACPI *acpi = new ACPI();
+
+    ACPIEventMask masks[HANDLERS];
+
+    for (size_t handler = 0; handler < HANDLERS; handler++) {
+
+        if (masked) {
+            masks[handler].set(handler % ACPIEventCount);
+        } else {
+            masks[handler].set();
+        }
+
+        acpi->addEventHandler([](ACPIEvent event) {
+            handled++;
+        }, masks[handler]);
+    }
+
+    acpi->setAcpidSocket(path);
+    acpi->start();
+
+    int client = accept(server, NULL, NULL);
+
+    handled = 0;
+
+    const Clock::time_point begin = Clock::now();
+    const double cpuBefore = cpuSeconds();
+
+    long sent = 0;
+    size_t next = 0;
+
+    while (sent < events) {
+
+        string batch;
+
+        for (int i = 0; i < BATCH && sent < events; i++, sent++) {
+            batch += lines[next];
+            batch += '\n';
+            next = (next + 1) % COUNT(lines);
+        }
+
+        if (write(client, batch.data(), batch.size()) != (ssize_t) batch.size()) {
+            std::cerr << "failed to write to the listener: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        /* until the batch was received and every handler it was for ran */
+        for (;;) {
+
+            const ACPIMetrics metrics = acpi->metrics();
+
+            if (received(metrics) >= sent && handled >= expected(metrics, masks)) break;
+
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    const double elapsed = (double) std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+    const double cpu = (cpuSeconds() - cpuBefore) * 1e6;
+
+    std::cout << (masked ? "one event each" : "every event   ") << ": "
+              << cpu / sent << " us of CPU and " << elapsed / sent << " us per event, "
+              << handled << " handler calls" << std::endl;
+
+    delete acpi;
+
+    close(client);
+
+    return cpu / sent;
+}
+
+int main(int argc, char **argv) {
+
+    const long events = argc > 1 ? atol(argv[1]) : 20000;
+
+    std::ostringstream path;
+    path << "/tmp/libthinkpad-dispatch-" << getpid() << ".socket";
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.str().c_str(), sizeof(addr.sun_path) - 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (server < 0 || bind(server, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 || listen(server, 1) < 0) {
+        std::cerr << "failed to listen on " << path.str() << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::cout << HANDLERS << " handlers, " << events << " events" << std::endl;
+
+    const double all = run(path.str(), server, events, false);
+    const double masked = run(path.str(), server, events, true);
+
+    if (masked > 0) {
+        std::cout << "masks are " << all / masked << "x faster" << std::endl;
+    }
+
+    close(server);
+    unlink(path.str().c_str());
+
+}
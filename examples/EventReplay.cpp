@@ -0,0 +1,84 @@
+#include <libthinkpad.h>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventMask;
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<long> handled(0);
+
+static int usage() {
+    std::cerr << "usage: EventReplay record <log>" << std::endl;
+    std::cerr << "       EventReplay replay <log> [speed, 0 for as fast as possible]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        return usage();
+    }
+
+    const string mode = argv[1];
+    const string log = argv[2];
+
+    ACPI *acpi = new ACPI();
+
+    acpi->addEventHandler([](ACPIEvent event) {
+        handled++;
+    }, ACPIEventMask().set());
+
+    if (mode == "record") {
+
+        if (!acpi->startRecording(log)) {
+            delete acpi;
+            return 1;
+        }
+
+        /* records until killed */
+        acpi->start();
+        acpi->wait();
+
+    } else if (mode == "replay") {
+
+        const double speed = argc > 3 ? atof(argv[3]) : 1.0;
+
+        acpi->start();
+
+        Clock::time_point begin = Clock::now();
+        long replayed = acpi->replay(log, speed);
+        Clock::duration took = Clock::now() - begin;
+
+        if (replayed < 0) {
+            delete acpi;
+            return 1;
+        }
+
+        long us = (long) std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+
+        /* let the workers finish the queued events */
+        delete acpi;
+
+        std::cout << "replayed " << replayed << " events in " << us << " us";
+
+        if (us > 0) {
+            std::cout << " (" << replayed * 1000000 / us << " events/s)";
+        }
+
+        std::cout << ", " << handled << " handled" << std::endl;
+
+        return 0;
+
+    } else {
+        delete acpi;
+        return usage();
+    }
+
+    delete acpi;
+
+}
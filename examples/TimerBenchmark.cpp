@@ -0,0 +1,77 @@
+#include <libthinkpad.h>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPITimerId;
+
+typedef std::chrono::steady_clock Clock;
+
+#define TIMERS 100000
+#define MAX_DELAY 2000
+
+static std::atomic<long> fired(0);
+static std::atomic<long> maxLate(0);
+
+static long microseconds(Clock::duration duration) {
+    return (long) std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+int main(void) {
+
+    ACPI *acpi = new ACPI();
+    acpi->start();
+
+    std::mt19937 random(42);
+    std::uniform_int_distribution<unsigned int> delays(1, MAX_DELAY);
+
+    std::vector<ACPITimerId> ids;
+    ids.reserve(TIMERS);
+
+    /* schedule */
+    Clock::time_point begin = Clock::now();
+
+    for (int i = 0; i < TIMERS; i++) {
+
+        unsigned int delay = delays(random);
+        Clock::time_point due = Clock::now() + std::chrono::milliseconds(delay);
+
+        ids.push_back(acpi->scheduleTimer(delay, [due]() {
+
+            long late = microseconds(Clock::now() - due);
+            long seen = maxLate.load();
+
+            while (late > seen && !maxLate.compare_exchange_weak(seen, late));
+
+            fired++;
+        }));
+    }
+
+    Clock::duration scheduling = Clock::now() - begin;
+
+    /* cancel every other timer */
+    begin = Clock::now();
+
+    long cancelled = 0;
+
+    for (int i = 0; i < TIMERS; i += 2) {
+        cancelled += acpi->cancelTimer(ids[i]);
+    }
+
+    Clock::duration cancelling = Clock::now() - begin;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(MAX_DELAY + 500));
+
+    std::cout << "scheduled " << TIMERS << " timers in " << microseconds(scheduling) << " us ("
+              << microseconds(scheduling) * 1000 / TIMERS << " ns each)" << std::endl;
+    std::cout << "cancelled " << cancelled << " timers in " << microseconds(cancelling) << " us ("
+              << microseconds(cancelling) * 1000 / (TIMERS / 2) << " ns each)" << std::endl;
+    std::cout << "fired " << fired << " timers, at most " << maxLate << " us late" << std::endl;
+
+    delete acpi;
+
+}
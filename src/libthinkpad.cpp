@@ -42,12 +42,57 @@
 #include <sstream>
 #include <iostream>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <libudev.h>
 #include <limits.h>
 #include <cstring>
 #include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <exception>
+#include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/input.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#endif
+
+/*
+ * USDT probes in the libthinkpad provider. A probe is a single nop until
+ * a tracer attaches to it, without USDT they are compiled out.
+ */
+#ifdef USDT
+
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(libthinkpad, name)
+#define PROBE1(name, a) DTRACE_PROBE1(libthinkpad, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(libthinkpad, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(libthinkpad, name, a, b, c)
+
+#else
+
+/* the arguments are not evaluated, only named */
+#define PROBE0(name) do {} while (0)
+#define PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+
+#endif
 
 using std::cout;
 using std::endl;
@@ -55,9 +100,144 @@ using std::ostringstream;
 
 namespace ThinkPad {
 
+    static uint64_t monotonicNow() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+    }
+
+    /******************** HardwareCache ********************/
+
+    /*
+     * Written by the event threads of the sources keeping it, read by
+     * anyone. Each value is atomic on its own, updated tells when all
+     * of them were read last.
+     */
+    struct CachedHardware {
+        std::atomic<bool> dockPresent;
+        std::atomic<bool> docked;
+        std::atomic<bool> thinkLightPresent;
+        std::atomic<bool> thinkLightOn;
+        std::atomic<float> backlight;
+        std::atomic<bool> batteryPresent[2];
+        std::atomic<uint64_t> updated;
+        std::atomic<int> keepers;
+    };
+
+    static CachedHardware cachedHardware;
+
+    static bool batteryPresent(const char *present) {
+        const int fd = open(present, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        char status[1];
+        ssize_t readBytes = read(fd, status, 1);
+        close(fd);
+        return readBytes == 1 && status[0] == '1';
+    }
+
+    bool Hardware::HardwareCache::get(HardwareState &state) {
+
+        const uint64_t updated = cachedHardware.updated.load(std::memory_order_acquire);
+
+        if (updated == 0 || monotonicNow() - updated > ACPI_CACHE_STALENESS * 1000000ull) {
+            return false;
+        }
+
+        state.dockPresent = cachedHardware.dockPresent.load(std::memory_order_relaxed);
+        state.docked = cachedHardware.docked.load(std::memory_order_relaxed);
+        state.thinkLightPresent = cachedHardware.thinkLightPresent.load(std::memory_order_relaxed);
+        state.thinkLightOn = cachedHardware.thinkLightOn.load(std::memory_order_relaxed);
+        state.backlight = cachedHardware.backlight.load(std::memory_order_relaxed);
+        state.batteryPresent[0] = cachedHardware.batteryPresent[0].load(std::memory_order_relaxed);
+        state.batteryPresent[1] = cachedHardware.batteryPresent[1].load(std::memory_order_relaxed);
+        state.updated = updated;
+
+        return true;
+    }
+
+    /* an event source starts keeping the cache */
+    void Hardware::HardwareCache::attach() {
+        cachedHardware.keepers++;
+        refresh();
+    }
+
+    /* the last source to let go of it leaves the getters to sysfs at once */
+    void Hardware::HardwareCache::detach() {
+        if (--cachedHardware.keepers == 0) {
+            cachedHardware.updated.store(0, std::memory_order_release);
+        }
+    }
+
+    void Hardware::HardwareCache::refresh() {
+
+        /* the values are at least as young as this */
+        const uint64_t now = monotonicNow();
+
+        refresh(IBM_DOCK);
+        refresh(SYSFS_THINKLIGHT);
+        refresh(SYSFS_BACKLIGHT_INTEL);
+        refresh(SYSFS_BATTERY_PRIMARY);
+
+        cachedHardware.updated.store(now, std::memory_order_release);
+    }
+
+    /*
+     * The ThinkLight changes without a uevent, it is read on every tick.
+     * The tick also tells the getters the rest is still kept current.
+     */
+    void Hardware::HardwareCache::tick() {
+
+        const uint64_t now = monotonicNow();
+
+        refresh(SYSFS_THINKLIGHT);
+
+        cachedHardware.updated.store(now, std::memory_order_release);
+    }
+
+    /* read again what the device at syspath has a say in, anything else is ignored */
+    void Hardware::HardwareCache::refresh(const char *syspath) {
+
+        if (strstr(syspath, IBM_DOCK) != NULL) {
+            Dock dock;
+            cachedHardware.dockPresent.store(dock.readProbe(), std::memory_order_relaxed);
+            cachedHardware.docked.store(dock.readDocked(), std::memory_order_relaxed);
+        } else if (strstr(syspath, "tpacpi::thinklight") != NULL) {
+            ThinkLight light;
+            const bool present = light.readProbe();
+            cachedHardware.thinkLightPresent.store(present, std::memory_order_relaxed);
+            cachedHardware.thinkLightOn.store(present && light.readOn(), std::memory_order_relaxed);
+        } else if (strstr(syspath, "/backlight/") != NULL) {
+            Backlight backlight;
+            cachedHardware.backlight.store(backlight.readBacklightLevel(), std::memory_order_relaxed);
+        } else if (strstr(syspath, "/power_supply/BAT") != NULL) {
+            cachedHardware.batteryPresent[0].store(batteryPresent(SYSFS_BATTERY_PRIMARY"/present"),
+                                                   std::memory_order_relaxed);
+            cachedHardware.batteryPresent[1].store(batteryPresent(SYSFS_BATTERY_SECONDARY"/present"),
+                                                   std::memory_order_relaxed);
+        }
+    }
+
     /******************** Dock ********************/
 
     bool Hardware::Dock::isDocked() {
+        HardwareState state;
+        if (HardwareCache::get(state)) {
+            return state.docked;
+        }
+        return readDocked();
+    }
+
+    bool Hardware::Dock::probe() {
+        HardwareState state;
+        if (HardwareCache::get(state)) {
+            return state.dockPresent;
+        }
+        return readProbe();
+    }
+
+    bool Hardware::Dock::readDocked() {
         const int fd = open(IBM_DOCK_DOCKED, O_RDONLY);
         if (fd == ERR_INVALID) {
             close(fd);
@@ -73,26 +253,20 @@ namespace ThinkPad {
         return status[0] == '1';
     }
 
-    bool Hardware::Dock::probe() {
+    bool Hardware::Dock::readProbe() {
         const int fd = open(IBM_DOCK_MODALIAS, O_RDONLY);
         if (fd == ERR_INVALID) {
             close(fd);
             return false;
         }
-        struct stat buf;
-        STATUS status = fstat(fd, &buf);
-        if (status == ERR_INVALID) {
-            close(fd);
-            return false;
-        }
-        // allocate +1 bytes for the null terminator
-        char readBuffer[buf.st_size + 1];
-        ssize_t bytesRead = read(fd, readBuffer, (size_t) buf.st_size);
-        readBuffer[buf.st_size] = 0;
+        // sysfs gives every attribute the size of a page, the modalias is a line
+        char readBuffer[BUFSIZE];
+        ssize_t bytesRead = read(fd, readBuffer, sizeof(readBuffer) - 1);
+        close(fd);
         if (bytesRead == ERR_INVALID) {
-            close(fd);
             return false;
         }
+        readBuffer[bytesRead] = 0;
         return strcmp(readBuffer, IBM_DOCK_ID) == 0;
     }
 
@@ -100,6 +274,8 @@ namespace ThinkPad {
 
     bool PowerManagement::PowerStateManager::suspend() {
 
+        PROBE0(suspend_entry);
+
 #ifdef SYSTEMD
 
         sd_bus_error error = SD_BUS_ERROR_NULL;
@@ -110,6 +286,7 @@ namespace ThinkPad {
 
         if (status < 0) {
             fprintf(stderr, "Connecting to D-Bus failed");
+            PROBE1(suspend_exit, status);
             return false;
         }
 
@@ -125,396 +302,4912 @@ namespace ThinkPad {
 
         if (status < 0) {
             fprintf(stderr, "Error calling suspend on logind: %s\n", error.message);
+            PROBE1(suspend_exit, status);
+            return false;
+        }
+
+        sd_bus_error_free(&error);
+        sd_bus_unref(bus);
+
+        PROBE1(suspend_exit, status);
+
+        return true;
+
+#endif
+
+        fprintf(stderr, "no suspend mechanism available\n");
+        PROBE1(suspend_exit, -ENOSYS);
+        return false;
+
+    }
+
+    bool PowerManagement::PowerStateManager::requestSuspend(SuspendReason reason) {
+
+        Hardware::Dock dock;
+
+        switch (reason) {
+            case SuspendReason::BUTTON:
+                return PowerManagement::PowerStateManager::suspend();
+            case SuspendReason::LID:
+                if (!dock.probe()) {
+                    fprintf(stderr, "dock is not sane/present");
+                    return false;
+                }
+
+                if(!dock.isDocked()) {
+                    PowerManagement::PowerStateManager::suspend();
+                    return true;
+                }
+
+                fprintf(stderr, "ignoring lid event when docked\n");
+                return false;
+            default:
+                fprintf(stderr, "invalid suspend reason \n");
+                return false;
+        }
+
+    }
+
+    /******************** ACPI ********************/
+
+    /*
+     * The runtime counters. Only ever incremented with relaxed atomics,
+     * nothing orders them against each other.
+     */
+    struct PowerManagement::ACPI::Counters {
+        std::atomic<uint64_t> received[ACPIEventCount];
+        std::atomic<uint64_t> invocations[ACPIEventCount];
+        std::atomic<uint64_t> failures[ACPIEventCount];
+        std::atomic<uint64_t> unknownLines;
+        std::atomic<uint64_t> purgedLines;
+        std::atomic<uint64_t> udevIgnored;
+        std::atomic<uint64_t> udevOverflows;
+        std::atomic<uint64_t> reconnects;
+        std::atomic<uint64_t> overruns[ACPIEventCount];
+        std::atomic<uint64_t> quarantined;
+        std::atomic<uint64_t> pollOverflowed;
+    };
+
+    static inline void count(std::atomic<uint64_t> &counter) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* the names of the events in the metrics, in ACPIEvent order */
+    static const char *acpiEventNames[PowerManagement::ACPIEventCount] = {
+        "power_s3s4_enter",
+        "power_s3s4_exit",
+        "lid_closed",
+        "lid_opened",
+        "docked",
+        "undocked",
+        "button_power",
+        "button_volume_up",
+        "button_volume_down",
+        "button_micmute",
+        "button_mute",
+        "button_thinkvantage",
+        "button_fnf2_lock",
+        "button_fnf3_battery",
+        "button_fnf4_sleep",
+        "button_fnf5_wlan",
+        "button_fnf7_projector",
+        "button_fnf12_suspend",
+        "unknown",
+        "button_brightness_down",
+        "button_brightness_up"
+    };
+
+    /*
+     * Call a handler, an exception thrown by it is counted as a failure
+     * instead of taking the event thread or a worker down
+     */
+    static void invokeHandler(PowerManagement::ACPICallback &callback, PowerManagement::ACPIHandlerId id,
+                              PowerManagement::ACPIEvent event, unsigned int repeat,
+                              std::atomic<uint64_t> &failures) {
+
+        bool failed = true;
+
+        PROBE3(handler_start, id, (int) event, repeat);
+
+        try {
+            callback(event, repeat);
+            failed = false;
+        } catch (const std::exception &e) {
+            fprintf(stderr, "ACPI handler failed: %s\n", e.what());
+            count(failures);
+        } catch (...) {
+            fprintf(stderr, "ACPI handler failed\n");
+            count(failures);
+        }
+
+        PROBE3(handler_end, id, (int) event, failed);
+    }
+
+    /*
+     * The timers of an ACPI instance live in a hierarchical timer wheel
+     * with TIMER_LEVELS levels of TIMER_SLOTS slots. A level 0 slot holds
+     * the timers due in one tick of one millisecond, a slot on the next
+     * level covers a whole turn of the level below, and so on. Timers far
+     * away wait in a coarse slot and are moved down a level whenever the
+     * wheel turns into their slot, until they land in level 0 and expire.
+     *
+     * Every timer is a node in the doubly linked list of its slot, so
+     * scheduling and cancelling are constant time. Nodes come from a pool
+     * and are addressed by index, the id of a timer carries a generation
+     * so a stale id never cancels a reused node.
+     *
+     * The wheel is driven by one timerfd, armed for the next tick that
+     * has anything to do.
+     */
+
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_CHUNK 256
+
+    struct PowerManagement::ACPI::TimerWheel {
+
+        struct Timer {
+            Timer *prev = nullptr;
+            Timer *next = nullptr;
+            uint64_t expires = 0;
+            uint32_t index = 0;
+            uint32_t generation = 1;
+            uint8_t level = 0;
+            uint8_t slot = 0;
+            bool pending = false;
+            ACPITimerCallback callback;
+        };
+
+        /* the CLOCK_MONOTONIC time of tick 0, in nanoseconds */
+        uint64_t origin;
+
+        /* every tick up to this one was processed */
+        uint64_t current = 0;
+
+        /* the tick the timerfd is armed for, 0 when it is disarmed */
+        uint64_t armed = 0;
+
+        Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+        uint64_t occupied[TIMER_LEVELS];
+
+        vector<std::unique_ptr<Timer[]>> chunks;
+        vector<Timer*> pool;
+        Timer *unused = nullptr;
+        size_t count = 0;
+
+        /* the callbacks of the expired timers, only used by the reactor */
+        vector<ACPITimerCallback> due;
+
+        pthread_mutex_t lock;
+        int fd;
+
+        TimerWheel() : origin(monotonicNow()) {
+
+            memset(this->slots, 0, sizeof(this->slots));
+            memset(this->occupied, 0, sizeof(this->occupied));
+
+            pthread_mutex_init(&this->lock, NULL);
+
+            this->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            if (this->fd < 0) {
+                fprintf(stderr, "failed to create the ACPI timer: %s\n", strerror(errno));
+            }
+        }
+
+        ~TimerWheel() {
+            if (this->fd >= 0) close(this->fd);
+            pthread_mutex_destroy(&this->lock);
+        }
+
+        uint64_t tick(uint64_t now) const {
+            return (now - this->origin) / 1000000ull;
+        }
+
+        Timer *allocate() {
+
+            if (this->unused == nullptr) {
+
+                std::unique_ptr<Timer[]> chunk(new Timer[TIMER_CHUNK]);
+
+                for (size_t i = 0; i < TIMER_CHUNK; i++) {
+                    chunk[i].index = (uint32_t) this->pool.size();
+                    chunk[i].next = this->unused;
+                    this->pool.push_back(&chunk[i]);
+                    this->unused = &chunk[i];
+                }
+
+                this->chunks.push_back(std::move(chunk));
+            }
+
+            Timer *timer = this->unused;
+            this->unused = timer->next;
+
+            return timer;
+        }
+
+        /* the id of the timer is stale from here on */
+        void free(Timer *timer) {
+            timer->pending = false;
+            timer->generation++;
+            timer->next = this->unused;
+            this->unused = timer;
+        }
+
+        void insert(Timer *timer) {
+
+            const uint64_t delta = timer->expires - this->current;
+            uint64_t expires = timer->expires;
+            unsigned int level = 0;
+
+            while (level < TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_BITS * (level + 1)))) {
+                level++;
+            }
+
+            /* beyond the last level, wait in its farthest slot and be moved again */
+            if (delta >= (1ull << (TIMER_BITS * TIMER_LEVELS))) {
+                expires = this->current + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+            }
+
+            const unsigned int slot = (unsigned int) (expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+
+            timer->level = (uint8_t) level;
+            timer->slot = (uint8_t) slot;
+            timer->prev = nullptr;
+            timer->next = this->slots[level][slot];
+
+            if (timer->next != nullptr) {
+                timer->next->prev = timer;
+            }
+
+            this->slots[level][slot] = timer;
+            this->occupied[level] |= 1ull << slot;
+        }
+
+        void unlink(Timer *timer) {
+
+            if (timer->prev != nullptr) {
+                timer->prev->next = timer->next;
+            } else {
+                this->slots[timer->level][timer->slot] = timer->next;
+            }
+
+            if (timer->next != nullptr) {
+                timer->next->prev = timer->prev;
+            }
+
+            if (this->slots[timer->level][timer->slot] == nullptr) {
+                this->occupied[timer->level] &= ~(1ull << timer->slot);
+            }
+        }
+
+        /*
+         * The next tick that expires a timer or moves timers down a level,
+         * 0 when the wheel is empty
+         */
+        uint64_t next() const {
+
+            if (this->count == 0) return 0;
+
+            uint64_t next = UINT64_MAX;
+
+            for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+
+                if (this->occupied[level] == 0) continue;
+
+                const unsigned int shift = TIMER_BITS * level;
+                const uint64_t position = this->current >> shift;
+
+                /* rotate so bit 0 is the slot after the current one */
+                const unsigned int first = (unsigned int) (position + 1) & (TIMER_SLOTS - 1);
+                const uint64_t ahead = (this->occupied[level] >> first) |
+                                       (this->occupied[level] << ((TIMER_SLOTS - first) & (TIMER_SLOTS - 1)));
+
+                const uint64_t tick = (position + 1 + __builtin_ctzll(ahead)) << shift;
+
+                next = std::min(next, tick);
+            }
+
+            return next;
+        }
+
+        /* expire the level 0 slot of tick after moving the timers that reached it */
+        void process(uint64_t tick) {
+
+            this->current = tick;
+
+            for (unsigned int level = 1; level < TIMER_LEVELS; level++) {
+
+                const unsigned int shift = TIMER_BITS * level;
+
+                if ((tick & ((1ull << shift) - 1)) != 0) break;
+
+                const unsigned int slot = (unsigned int) (tick >> shift) & (TIMER_SLOTS - 1);
+                Timer *timer = this->slots[level][slot];
+
+                this->slots[level][slot] = nullptr;
+                this->occupied[level] &= ~(1ull << slot);
+
+                while (timer != nullptr) {
+                    Timer *next = timer->next;
+                    insert(timer);
+                    timer = next;
+                }
+            }
+
+            const unsigned int slot = (unsigned int) tick & (TIMER_SLOTS - 1);
+            Timer *timer = this->slots[0][slot];
+
+            this->slots[0][slot] = nullptr;
+            this->occupied[0] &= ~(1ull << slot);
+
+            while (timer != nullptr) {
+                Timer *next = timer->next;
+                this->due.push_back(std::move(timer->callback));
+                this->count--;
+                free(timer);
+                timer = next;
+            }
+        }
+
+        /* process every tick up to now, the expired callbacks are left in due */
+        void advance(uint64_t now) {
+
+            for (uint64_t next = this->next(); next != 0 && next <= now; next = this->next()) {
+                process(next);
+            }
+
+            this->current = std::max(this->current, now);
+        }
+
+        void arm(uint64_t tick) {
+
+            if (this->fd < 0) return;
+
+            this->armed = tick;
+
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(struct itimerspec));
+
+            if (tick != 0) {
+                const uint64_t deadline = this->origin + tick * 1000000ull;
+                spec.it_value.tv_sec = (time_t) (deadline / 1000000000ull);
+                spec.it_value.tv_nsec = (long) (deadline % 1000000000ull);
+            }
+
+            timerfd_settime(this->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+        }
+    };
+
+    PowerManagement::ACPITimerId PowerManagement::ACPI::addTimer(unsigned int delay,
+                                                                 ACPITimerCallback &&callback) {
+
+        TimerWheel *wheel = this->timers;
+
+        const uint64_t time = monotonicNow();
+        const uint64_t now = wheel->tick(time);
+
+        /* rounded up, a timer never runs before its delay is over */
+        const uint64_t expires = wheel->tick(time + delay * 1000000ull + 999999ull);
+
+        pthread_mutex_lock(&wheel->lock);
+
+        /* an empty wheel can skip the ticks nobody was waiting for */
+        if (wheel->count == 0) {
+            wheel->current = std::max(wheel->current, now);
+        }
+
+        TimerWheel::Timer *timer = wheel->allocate();
+
+        timer->callback = std::move(callback);
+        timer->expires = std::max(expires, wheel->current + 1);
+        timer->pending = true;
+
+        wheel->insert(timer);
+        wheel->count++;
+
+        const uint64_t next = wheel->next();
+
+        if (wheel->armed == 0 || next < wheel->armed) {
+            wheel->arm(next);
+        }
+
+        const ACPITimerId id = ((ACPITimerId) timer->generation << 32) | timer->index;
+
+        pthread_mutex_unlock(&wheel->lock);
+
+        return id;
+
+    }
+
+    bool PowerManagement::ACPI::cancelTimer(ACPITimerId id) {
+
+        TimerWheel *wheel = this->timers;
+
+        const uint32_t index = (uint32_t) id;
+        const uint32_t generation = (uint32_t) (id >> 32);
+
+        ACPITimerCallback callback;
+
+        pthread_mutex_lock(&wheel->lock);
+
+        if (index >= wheel->pool.size()) {
+            pthread_mutex_unlock(&wheel->lock);
+            return false;
+        }
+
+        TimerWheel::Timer *timer = wheel->pool[index];
+
+        if (!timer->pending || timer->generation != generation) {
+            pthread_mutex_unlock(&wheel->lock);
+            return false;
+        }
+
+        wheel->unlink(timer);
+        wheel->count--;
+
+        /* destroyed after unlocking, it may cancel timers itself */
+        callback = std::move(timer->callback);
+        wheel->free(timer);
+
+        pthread_mutex_unlock(&wheel->lock);
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::runTimers() {
+
+        TimerWheel *wheel = this->timers;
+
+        uint64_t expirations;
+
+        if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "failed to read the ACPI timer: %s\n", strerror(errno));
+        }
+
+        const uint64_t now = wheel->tick(monotonicNow());
+
+        pthread_mutex_lock(&wheel->lock);
+        wheel->advance(now);
+        wheel->arm(wheel->next());
+        pthread_mutex_unlock(&wheel->lock);
+
+        /* only the reactor touches due, the callbacks may schedule again */
+        for (ACPITimerCallback &callback : wheel->due) {
+            callback();
+        }
+
+        wheel->due.clear();
+
+    }
+
+    static PowerManagement::ACPIEvent classifyAcpid(const char *buf) {
+
+        PowerManagement::ACPIEvent event = PowerManagement::ACPIEvent::UNKNOWN;
+
+        if (strstr(buf, ACPI_POWERBUTTON) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_POWER;
+        }
+
+        if (strstr(buf, ACPI_LID_OPEN) != NULL) {
+            event = PowerManagement::ACPIEvent::LID_OPENED;
+        }
+
+        if (strstr(buf, ACPI_LID_CLOSE) != NULL) {
+            event = PowerManagement::ACPIEvent::LID_CLOSED;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_VOLUME_UP) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_VOLUME_UP;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_VOLUME_DOWN) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_VOLUME_DOWN;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_DOWN) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_DOWN;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_UP) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_UP;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_MICMUTE) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_MICMUTE;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_MUTE) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_MUTE;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_THINKVANTAGE) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF2_LOCK) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF2_LOCK;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF3_BATTERY) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF3_BATTERY;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF5_WLAN) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF5_WLAN;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF4_SLEEP) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF4_SLEEP;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF7_PROJECTOR) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF7_PROJECTOR;
+        }
+
+        if (strstr(buf, ACPI_BUTTON_FNF12_HIBERNATE) != NULL) {
+            event = PowerManagement::ACPIEvent::BUTTON_FNF12_SUSPEND;
+        }
+
+        if (strstr(buf, ACPI_DOCK_EVENT) != NULL ||
+            strstr(buf, ACPI_DOCK_EVENT2) != NULL) {
+            event = PowerManagement::ACPIEvent::DOCKED;
+        }
+
+        if (strstr(buf, ACPI_UNDOCK_EVENT) != NULL ||
+            strstr(buf, ACPI_UNDOCK_EVENT2) != NULL) {
+            event = PowerManagement::ACPIEvent::UNDOCKED;
+        }
+
+        return event;
+    }
+
+    /* the event log of ACPI::startRecording, see there for the format */
+    #define RECORD_MAGIC "TPEVLOG1"
+    #define RECORD_MAGIC_SIZE 8
+
+    enum RecordSource {
+        RECORD_ACPID = 1,
+        RECORD_UDEV = 2,
+        RECORD_NETLINK = 3,
+        RECORD_INPUT = 4,
+        RECORD_LOGIND = 5,
+        RECORD_STATE = 6
+    };
+
+    struct RecordHeader {
+        uint64_t time;
+        uint16_t length;
+        uint8_t source;
+        uint8_t reserved[5];
+    };
+
+    static_assert(sizeof(RecordHeader) == 16, "the record header is 16 bytes in the log");
+
+    /*
+     * The epoll data of the sources of an event source. The timers of
+     * the instances are watched with the instance as the data instead,
+     * which never is one of these small values.
+     */
+    enum ReactorSource {
+        SOURCE_WAKE,
+        SOURCE_RECONNECT,
+        SOURCE_ACPID,
+        SOURCE_UDEV,
+        SOURCE_NETLINK,
+        SOURCE_INPUT,
+        SOURCE_LOGIND,
+        SOURCE_CACHE,
+        SOURCE_BUS_TIMER,
+        SOURCE_COUNT
+    };
+
+    static bool reactorWatch(int epollFd, int fd, uint64_t data) {
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+
+        event.events = EPOLLIN;
+        event.data.u64 = data;
+
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    /* the generic netlink family of drivers/acpi/event.c */
+    #define ACPI_GENL_FAMILY_NAME "acpi_event"
+    #define ACPI_GENL_MCAST_GROUP_NAME "acpi_mc_group"
+    #define ACPI_GENL_CMD_EVENT 1
+    #define ACPI_GENL_ATTR_EVENT 1
+
+    /* a page, what the kernel puts into one datagram at most */
+    #define NETLINK_BUFSIZE 8192
+
+    /* the ThinkPad hotkey codes of the dock */
+    #define TPACPI_HKEY_DOCKED 0x4010
+    #define TPACPI_HKEY_UNDOCKED 0x4011
+
+    /* struct acpi_genl_event as the kernel sends it */
+    struct PowerManagement::ACPI::KernelEvent {
+        char deviceClass[20];
+        char busId[15];
+        uint32_t type;
+        uint32_t data;
+    };
+
+    /* calls function(type, payload, length) for every attribute of a netlink message */
+    template<typename F>
+    static void netlinkAttributes(const char *data, size_t length, F function) {
+
+        while (length >= NLA_HDRLEN) {
+
+            const struct nlattr *attribute = (const struct nlattr*) data;
+
+            if (attribute->nla_len < NLA_HDRLEN || attribute->nla_len > length) return;
+
+            function(attribute->nla_type & NLA_TYPE_MASK, data + NLA_HDRLEN, attribute->nla_len - NLA_HDRLEN);
+
+            const size_t step = NLA_ALIGN(attribute->nla_len);
+
+            if (step >= length) return;
+
+            data += step;
+            length -= step;
+        }
+    }
+
+    /*
+     * The kernel reports that the lid changed, not how. The button
+     * driver has the state in /proc/acpi/button/lid/<device>/state.
+     */
+    static PowerManagement::ACPIEvent lidState() {
+
+        DIR *lids = opendir(PROC_ACPI_LID);
+
+        if (lids == NULL) {
+            return PowerManagement::ACPIEvent::UNKNOWN;
+        }
+
+        PowerManagement::ACPIEvent event = PowerManagement::ACPIEvent::UNKNOWN;
+
+        for (struct dirent *lid = readdir(lids); lid != NULL; lid = readdir(lids)) {
+
+            if (lid->d_name[0] == '.') continue;
+
+            string path = string(PROC_ACPI_LID) + "/" + lid->d_name + "/state";
+
+            char state[64];
+
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+
+            ssize_t length = read(fd, state, sizeof(state) - 1);
+            close(fd);
+
+            if (length <= 0) continue;
+
+            state[length] = '\0';
+
+            if (strstr(state, "open") != NULL) {
+                event = PowerManagement::ACPIEvent::LID_OPENED;
+            } else if (strstr(state, "closed") != NULL) {
+                event = PowerManagement::ACPIEvent::LID_CLOSED;
+            }
+
+            break;
+        }
+
+        closedir(lids);
+
+        return event;
+    }
+
+    /* the input events read at once from a device */
+    #define INPUT_BATCH 64
+
+    /* the keys of the input devices that are hotkeys */
+    static const struct {
+        uint16_t code;
+        PowerManagement::ACPIEvent event;
+    } inputKeys[] = {
+        { KEY_VOLUMEUP, PowerManagement::ACPIEvent::BUTTON_VOLUME_UP },
+        { KEY_VOLUMEDOWN, PowerManagement::ACPIEvent::BUTTON_VOLUME_DOWN },
+        { KEY_MUTE, PowerManagement::ACPIEvent::BUTTON_MUTE },
+        { KEY_MICMUTE, PowerManagement::ACPIEvent::BUTTON_MICMUTE },
+        { KEY_BRIGHTNESSUP, PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_UP },
+        { KEY_BRIGHTNESSDOWN, PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_DOWN },
+        { KEY_PROG1, PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE },
+        { KEY_VENDOR, PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE },
+        { KEY_SCREENLOCK, PowerManagement::ACPIEvent::BUTTON_FNF2_LOCK },
+        { KEY_BATTERY, PowerManagement::ACPIEvent::BUTTON_FNF3_BATTERY },
+        { KEY_SLEEP, PowerManagement::ACPIEvent::BUTTON_FNF4_SLEEP },
+        { KEY_WLAN, PowerManagement::ACPIEvent::BUTTON_FNF5_WLAN },
+        { KEY_SWITCHVIDEOMODE, PowerManagement::ACPIEvent::BUTTON_FNF7_PROJECTOR },
+        { KEY_SUSPEND, PowerManagement::ACPIEvent::BUTTON_FNF12_SUSPEND }
+    };
+
+    /* the event of a key code, UNKNOWN for the keys that are not hotkeys */
+    static PowerManagement::ACPIEvent classifyInputKey(uint16_t code) {
+
+        static const vector<PowerManagement::ACPIEvent> table = []() {
+
+            vector<PowerManagement::ACPIEvent> table(KEY_CNT, PowerManagement::ACPIEvent::UNKNOWN);
+
+            for (const auto &key : inputKeys) {
+                table[key.code] = key.event;
+            }
+
+            return table;
+        }();
+
+        return code < KEY_CNT ? table[code] : PowerManagement::ACPIEvent::UNKNOWN;
+    }
+
+    static bool isHotkeyDevice(const char *name) {
+        return strcmp(name, INPUT_THINKPAD_BUTTONS) == 0 ||
+               strcmp(name, INPUT_AT_KEYBOARD) == 0 ||
+               strcmp(name, INPUT_VIDEO_BUS) == 0;
+    }
+
+    /* a single producer, single consumer ring of events */
+    struct PowerManagement::ACPI::PollRing {
+
+        /* written by the consumer and the producer, kept a cache line apart */
+        std::atomic<size_t> head;
+        char headPadding[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+        char tailPadding[64 - sizeof(std::atomic<size_t>)];
+
+        ACPIEvent events[ACPI_POLL_RING];
+
+        PollRing() : head(0), tail(0) {}
+
+        bool push(ACPIEvent event) {
+
+            const size_t position = this->tail.load(std::memory_order_relaxed);
+
+            if (position - this->head.load(std::memory_order_acquire) == ACPI_POLL_RING) {
+                return false;
+            }
+
+            this->events[position % ACPI_POLL_RING] = event;
+            this->tail.store(position + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        size_t pop(ACPIEvent *events, size_t max) {
+
+            const size_t position = this->head.load(std::memory_order_relaxed);
+            const size_t available = this->tail.load(std::memory_order_acquire) - position;
+            const size_t taken = std::min(available, max);
+
+            for (size_t i = 0; i < taken; i++) {
+                events[i] = this->events[(position + i) % ACPI_POLL_RING];
+            }
+
+            this->head.store(position + taken, std::memory_order_release);
+
+            return taken;
+        }
+
+        size_t size() const {
+            return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire);
+        }
+    };
+
+    static_assert((ACPI_POLL_RING & (ACPI_POLL_RING - 1)) == 0, "ACPI_POLL_RING must be a power of two");
+
+    /*
+     * Every ACPI instance of the process that listens on the same acpid
+     * socket shares one event source: one acpid connection, one udev
+     * monitor and one reactor thread. The source reads every line and
+     * device once and hands it to each instance, which filters it and
+     * dispatches it to its own handlers. The timers of the instances run
+     * on the reactor of their source as well.
+     *
+     * Instances that take the events from the kernel share a source
+     * that reads the acpi_event netlink group in place of acpid, see
+     * setNetlinkSource. The first instance that starts creates the
+     * source, the last one that stops frees it. A polled instance has a source of its own
+     * without a thread, see startPolling.
+     */
+    struct PowerManagement::ACPI::EventSource {
+
+        /* the key of the source in sources */
+        string key;
+
+        string path;
+        bool threaded;
+
+        /* read the kernel instead of acpid, from injectedFd if that is set */
+        bool netlink;
+        int injectedFd;
+
+        /* read the input devices too, or the files in injectedInputs */
+        bool input;
+        vector<int> injectedInputs;
+
+        /* the sleep events come from logind, not from the machinecheck devices */
+        bool logind;
+
+        /*
+         * Hold the sleep with a delay inhibitor until every instance
+         * is done with its pre-sleep handlers, see ACPI::setPreSleep.
+         * sleepLock guards the inhibitor and the instances not done.
+         */
+        bool delay;
+        pthread_mutex_t sleepLock;
+        int inhibitFd = -1;
+        vector<ACPI*> sleepPending;
+
+        /* keep the hardware cache, see ACPI::setHardwareCache */
+        bool cache;
+
+        /*
+         * The instances listening. The reactor holds the lock while it
+         * handles a wakeup, so an instance that unsubscribed is not used
+         * anymore. It is recursive for the handlers and timers run from
+         * there that start or stop other instances.
+         */
+        vector<ACPI*> subscribers;
+        pthread_mutex_t lock;
+
+        /* the instances a line or device is handed to, only used by the reactor */
+        vector<ACPI*> targets;
+
+        /* the instances that acquired the source, guarded by sourcesLock */
+        size_t references = 0;
+
+        pthread_t thread;
+        bool running = false;
+        std::atomic<bool> stopping;
+
+        int epollFd = -1;
+        int wakeFd = -1;
+        int reconnectFd = -1;
+
+        /* ticks every ACPI_CACHE_STALENESS / 2 while keeping the hardware cache */
+        int cacheFd = -1;
+        unsigned int cacheTicks = 0;
+
+        int acpidFd = -1;
+        unsigned int acpidBackoff = ACPID_RECONNECT_MIN;
+
+        /* an acpid connection was made before */
+        bool acpidConnected = false;
+
+        /* the acpid line being assembled, overlong lines are purged */
+        char acpidLine[BUFSIZE];
+        size_t acpidLength = 0;
+        bool acpidPurging = false;
+
+        struct udev *udev = nullptr;
+        struct udev_monitor *udevMonitor = nullptr;
+        int udevFd = -1;
+
+        /* the acpi_event family, 0 accepts any generic netlink message */
+        int kernelFd = -1;
+        uint16_t genlFamily = 0;
+
+        /* an input device and the start of an event a read cut off */
+        struct InputDevice {
+            int fd;
+            size_t pending;
+            char partial[sizeof(struct input_event)];
+        };
+
+        /* the input devices are watched in an epoll set of their own */
+        int inputEpollFd = -1;
+        vector<InputDevice> inputDevices;
+
+#ifdef SYSTEMD
+
+        /* the system bus, open for as long as the source is */
+        sd_bus *bus = nullptr;
+        sd_bus_slot *sleepSlot = nullptr;
+        sd_bus_slot *inhibitSlot = nullptr;
+
+#endif
+
+        /*
+         * Armed for the timeouts of sd-bus while the bus is connected,
+         * for the next attempt to connect again after it was lost.
+         */
+        int busTimerFd = -1;
+        unsigned int busBackoff = ACPID_RECONNECT_MIN;
+
+        static pthread_mutex_t sourcesLock;
+        static std::map<string, EventSource*> *sources;
+
+        EventSource(ACPI *acpi, bool threaded) : key(keyOf(acpi)), path(acpi->acpidSocket), threaded(threaded),
+                                                 netlink(acpi->netlinkSource), injectedFd(acpi->netlinkFd),
+                                                 input(acpi->inputSource), injectedInputs(acpi->inputFds),
+                                                 logind(acpi->logindSource), delay(acpi->preSleepDeadline != 0),
+                                                 cache(acpi->hardwareCache),
+                                                 stopping(false) {
+
+            pthread_mutex_init(&this->sleepLock, NULL);
+
+            pthread_mutexattr_t attributes;
+            pthread_mutexattr_init(&attributes);
+            pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+            pthread_mutex_init(&this->lock, &attributes);
+            pthread_mutexattr_destroy(&attributes);
+        }
+
+        ~EventSource() {
+
+            stop();
+
+            disconnectAcpid();
+
+            if (this->kernelFd >= 0) close(this->kernelFd);
+
+            for (const InputDevice &device : this->inputDevices) {
+                if (device.fd >= 0) close(device.fd);
+            }
+
+            if (this->inputEpollFd >= 0) close(this->inputEpollFd);
+
+#ifdef SYSTEMD
+
+            if (this->inhibitSlot != nullptr) sd_bus_slot_unref(this->inhibitSlot);
+            if (this->sleepSlot != nullptr) sd_bus_slot_unref(this->sleepSlot);
+            if (this->bus != nullptr) sd_bus_flush_close_unref(this->bus);
+
+#endif
+
+            if (this->udevMonitor != nullptr) udev_monitor_unref(this->udevMonitor);
+            if (this->udev != nullptr) udev_unref(this->udev);
+
+            if (this->busTimerFd >= 0) close(this->busTimerFd);
+
+            if (this->cacheFd >= 0) {
+                close(this->cacheFd);
+                Hardware::HardwareCache::detach();
+            }
+
+            if (this->reconnectFd >= 0) close(this->reconnectFd);
+            if (this->wakeFd >= 0) close(this->wakeFd);
+            if (this->epollFd >= 0) close(this->epollFd);
+            if (this->inhibitFd >= 0) close(this->inhibitFd);
+
+            pthread_mutex_destroy(&this->sleepLock);
+            pthread_mutex_destroy(&this->lock);
+        }
+
+        bool open();
+        bool start();
+        void stop();
+
+        void subscribe(ACPI *acpi);
+        void unsubscribe(ACPI *acpi);
+        bool subscribed(ACPI *acpi) const;
+
+        void handle(struct epoll_event *events, int count);
+        void poll();
+        static void *reactor(void*);
+
+        void connectAcpid();
+        void disconnectAcpid();
+        void readAcpid();
+        void readUdev();
+
+        bool openNetlink();
+        bool resolveNetlink();
+        void readNetlink();
+
+        bool openInput();
+        void addInputDevice(int fd);
+        void readInput();
+        void readInputDevice(InputDevice &device);
+
+        bool openLogind();
+        void readLogind();
+        void readBusTimer();
+        void preSleepDone(ACPI *acpi);
+
+        bool openCache();
+        void readCache();
+
+#ifdef SYSTEMD
+
+        bool connectBus(bool wait);
+        void closeBus();
+        void retryBus();
+        void watchBus();
+        bool inhibit(bool wait);
+        void inhibited(sd_bus_message *reply);
+        static int prepareForSleep(sd_bus_message *message, void *_this, sd_bus_error *error);
+        static int inhibitReplied(sd_bus_message *reply, void *_this, sd_bus_error *error);
+
+#endif
+
+        /* a polled instance has not drained enough to take more */
+        bool backlogged() const {
+            return !this->threaded && !this->subscribers.empty() &&
+                   this->subscribers[0]->ring->size() >= ACPI_POLL_RING / 2;
+        }
+
+        /* hand something to every instance still listening */
+        template<typename F>
+        void fanOut(F function) {
+
+            this->targets = this->subscribers;
+
+            for (ACPI *acpi : this->targets) {
+                if (subscribed(acpi)) {
+                    function(acpi);
+                }
+            }
+        }
+
+        static string keyOf(ACPI *acpi);
+        static EventSource *acquire(ACPI *acpi);
+        static void release(EventSource *source);
+    };
+
+    pthread_mutex_t PowerManagement::ACPI::EventSource::sourcesLock = PTHREAD_MUTEX_INITIALIZER;
+
+    /* never freed, instances may still stop during exit */
+    std::map<string, PowerManagement::ACPI::EventSource*> *PowerManagement::ACPI::EventSource::sources = nullptr;
+
+    bool PowerManagement::ACPI::EventSource::open() {
+
+        this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        this->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        this->reconnectFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (this->epollFd < 0 || this->wakeFd < 0 || this->reconnectFd < 0 ||
+            !reactorWatch(this->epollFd, this->wakeFd, SOURCE_WAKE) ||
+            !reactorWatch(this->epollFd, this->reconnectFd, SOURCE_RECONNECT)) {
+            fprintf(stderr, "failed to set up the ACPI event loop: %s\n", strerror(errno));
+            return false;
+        }
+
+#ifdef DEBUG
+
+        printf("starting udev listener...\n");
+
+#endif
+
+        this->udev = udev_new();
+        this->udevMonitor = udev_monitor_new_from_netlink(this->udev, "udev");
+
+        /*
+         * The subsystem filters run in the kernel, on the socket. libudev
+         * can not filter on the sysname there, see udevRelevant for the
+         * devices of these subsystems that are of interest. A tag filter
+         * would, but it is ANDed with these and the dock and machinecheck
+         * devices carry no tag unless a udev rule gives them one, so every
+         * platform device still reaches the socket.
+         */
+        udev_monitor_filter_add_match_subsystem_devtype(this->udevMonitor, "platform", NULL);
+
+        if (!this->logind) {
+            udev_monitor_filter_add_match_subsystem_devtype(this->udevMonitor, "machinecheck", NULL);
+        }
+
+        if (this->cache) {
+            udev_monitor_filter_add_match_subsystem_devtype(this->udevMonitor, "backlight", NULL);
+            udev_monitor_filter_add_match_subsystem_devtype(this->udevMonitor, "leds", NULL);
+            udev_monitor_filter_add_match_subsystem_devtype(this->udevMonitor, "power_supply", NULL);
+        }
+
+        udev_monitor_enable_receiving(this->udevMonitor);
+
+        this->udevFd = udev_monitor_get_fd(this->udevMonitor);
+
+        /*
+         * Every core removes and adds its machinecheck device around a
+         * suspend, all at once. Forcing the size needs CAP_NET_ADMIN,
+         * without it the kernel caps it at net.core.rmem_max.
+         */
+        if (udev_monitor_set_receive_buffer_size(this->udevMonitor, ACPI_UDEV_BUFFER) < 0) {
+
+            const int size = ACPI_UDEV_BUFFER;
+
+            if (setsockopt(this->udevFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+                fprintf(stderr, "failed to enlarge the udev receive buffer: %s\n", strerror(errno));
+            }
+        }
+
+        if (!reactorWatch(this->epollFd, this->udevFd, SOURCE_UDEV)) {
+            fprintf(stderr, "failed to watch udev: %s\n", strerror(errno));
+        }
+
+        if (this->input && !openInput()) {
+            return false;
+        }
+
+        if (this->logind && !openLogind()) {
+            return false;
+        }
+
+        if (this->cache && !openCache()) {
+            return false;
+        }
+
+        if (this->netlink) {
+            return openNetlink();
+        }
+
+        connectAcpid();
+
+        return true;
+
+    }
+
+    bool PowerManagement::ACPI::EventSource::start() {
+
+        this->stopping = false;
+
+        if (pthread_create(&this->thread, NULL, reactor, this) != 0) {
+            fprintf(stderr, "failed to start the ACPI event loop\n");
+            return false;
+        }
+
+        this->running = true;
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::stop() {
+
+        if (!this->running) return;
+
+        this->stopping = true;
+
+        const uint64_t wake = 1;
+
+        if (write(this->wakeFd, &wake, sizeof(wake)) < 0) {
+            fprintf(stderr, "failed to wake the ACPI event loop: %s\n", strerror(errno));
+        }
+
+        pthread_join(this->thread, NULL);
+        this->running = false;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::subscribe(ACPI *acpi) {
+
+        pthread_mutex_lock(&this->lock);
+
+        this->subscribers.push_back(acpi);
+
+        if (!reactorWatch(this->epollFd, acpi->timers->fd, (uint64_t) (uintptr_t) acpi)) {
+            fprintf(stderr, "failed to watch the ACPI timer: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_unlock(&this->lock);
+
+    }
+
+    void PowerManagement::ACPI::EventSource::unsubscribe(ACPI *acpi) {
+
+        /* waits for the reactor to be done with the instance */
+        pthread_mutex_lock(&this->lock);
+
+        this->subscribers.erase(std::remove(this->subscribers.begin(), this->subscribers.end(), acpi),
+                                this->subscribers.end());
+
+        epoll_ctl(this->epollFd, EPOLL_CTL_DEL, acpi->timers->fd, NULL);
+
+        /* the sleep does not wait for it anymore */
+        preSleepDone(acpi);
+
+        pthread_mutex_unlock(&this->lock);
+
+    }
+
+    bool PowerManagement::ACPI::EventSource::subscribed(ACPI *acpi) const {
+        return std::find(this->subscribers.begin(), this->subscribers.end(), acpi) != this->subscribers.end();
+    }
+
+    string PowerManagement::ACPI::EventSource::keyOf(ACPI *acpi) {
+
+        std::ostringstream key;
+
+        if (!acpi->netlinkSource) {
+            key << acpi->acpidSocket;
+        } else if (acpi->netlinkFd < 0) {
+            key << "genl";
+        } else {
+            key << "genl:" << acpi->netlinkFd;
+        }
+
+        if (acpi->inputSource) {
+
+            key << "+input";
+
+            for (int fd : acpi->inputFds) {
+                key << ":" << fd;
+            }
+        }
+
+        if (acpi->logindSource) {
+            key << "+logind";
+        }
+
+        if (acpi->preSleepDeadline != 0) {
+            key << "+delay";
+        }
+
+        if (acpi->hardwareCache) {
+            key << "+cache";
+        }
+
+        return key.str();
+    }
+
+    PowerManagement::ACPI::EventSource *PowerManagement::ACPI::EventSource::acquire(ACPI *acpi) {
+
+        const string key = keyOf(acpi);
+
+        pthread_mutex_lock(&sourcesLock);
+
+        if (sources == nullptr) {
+            sources = new std::map<string, EventSource*>;
+        }
+
+        EventSource *&source = (*sources)[key];
+
+        if (source == nullptr) {
+
+            source = new EventSource(acpi, true);
+
+            if (!source->open() || !source->start()) {
+                delete source;
+                sources->erase(key);
+                pthread_mutex_unlock(&sourcesLock);
+                return nullptr;
+            }
+        }
+
+        EventSource *acquired = source;
+        acquired->references++;
+
+        pthread_mutex_unlock(&sourcesLock);
+
+        /*
+         * Not under sourcesLock, the reactor may be running a handler
+         * that starts another instance and waits for it
+         */
+        acquired->subscribe(acpi);
+
+        return acquired;
+
+    }
+
+    /* the instance letting go of it unsubscribed already */
+    void PowerManagement::ACPI::EventSource::release(EventSource *source) {
+
+        pthread_mutex_lock(&sourcesLock);
+
+        const bool last = --source->references == 0;
+
+        if (last) {
+            sources->erase(source->key);
+        }
+
+        pthread_mutex_unlock(&sourcesLock);
+
+        if (last) {
+            delete source;
+        }
+
+    }
+
+    void PowerManagement::ACPI::EventSource::connectAcpid() {
+
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, this->path.c_str(), sizeof(addr.sun_path) - 1);
+
+        int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sfd < 0 || connect(sfd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 ||
+            !reactorWatch(this->epollFd, sfd, SOURCE_ACPID)) {
+
+            printf("Connect failed: %s, retrying in %u ms\n", strerror(errno), this->acpidBackoff);
+
+            if (sfd >= 0) close(sfd);
+
+            struct itimerspec retry;
+            memset(&retry, 0, sizeof(struct itimerspec));
+
+            retry.it_value.tv_sec = this->acpidBackoff / 1000;
+            retry.it_value.tv_nsec = (long) (this->acpidBackoff % 1000) * 1000000l;
+
+            timerfd_settime(this->reconnectFd, 0, &retry, NULL);
+
+            this->acpidBackoff = std::min(this->acpidBackoff * 2, (unsigned int) ACPID_RECONNECT_MAX);
+
+            return;
+        }
+
+#ifdef DEBUG
+
+        printf("starting acpid listener...\n");
+
+#endif
+
+        if (this->acpidConnected || this->acpidBackoff != ACPID_RECONNECT_MIN) {
+            fanOut([](ACPI *acpi) { count(acpi->counters->reconnects); });
+        }
+
+        this->acpidFd = sfd;
+        this->acpidConnected = true;
+        this->acpidBackoff = ACPID_RECONNECT_MIN;
+        this->acpidLength = 0;
+        this->acpidPurging = false;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::disconnectAcpid() {
+
+        if (this->acpidFd < 0) return;
+
+        /* closing the socket removes it from the epoll set */
+        close(this->acpidFd);
+        this->acpidFd = -1;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readAcpid() {
+
+        char chunk[INBUFSZ];
+
+        for (;;) {
+
+            /* let the host drain first, the rest stays in the socket until then */
+            if (backlogged()) {
+                return;
+            }
+
+            ssize_t length = read(this->acpidFd, chunk, INBUFSZ);
+
+            if (length < 0 && errno == EINTR) continue;
+            if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+            if (length <= 0) {
+                fprintf(stderr, "lost the acpid connection, reconnecting...\n");
+                disconnectAcpid();
+                connectAcpid();
+                return;
+            }
+
+            /* every line of the chunk arrived at once */
+            const uint64_t now = monotonicNow();
+
+            const char *begin = chunk;
+            const char *end = chunk + length;
+
+            while (begin < end) {
+
+                const char *newline = (const char*) memchr(begin, '\n', end - begin);
+                const char *stop = newline != NULL ? newline : end;
+                const size_t size = stop - begin;
+
+                if (!this->acpidPurging && this->acpidLength + size >= BUFSIZE) {
+                    printf("Buffer full, purging event...\n");
+                    fanOut([](ACPI *acpi) { count(acpi->counters->purgedLines); });
+                    this->acpidPurging = true;
+                }
+
+                if (!this->acpidPurging) {
+                    memcpy(this->acpidLine + this->acpidLength, begin, size);
+                    this->acpidLength += size;
+                }
+
+                if (newline == NULL) break;
+
+                if (!this->acpidPurging) {
+                    this->acpidLine[this->acpidLength] = '\0';
+
+                    fanOut([this, now](ACPI *acpi) {
+                        acpi->receiveAcpidLine(this->acpidLine, this->acpidLength, now);
+                    });
+                }
+
+                this->acpidLength = 0;
+                this->acpidPurging = false;
+
+                begin = newline + 1;
+            }
+        }
+    }
+
+    /* the devices handleUdevDevice knows, the rest of their subsystems is dropped here */
+    static bool udevRelevant(const char *syspath, bool machinecheck) {
+        return strstr(syspath, IBM_DOCK) != NULL || (machinecheck && strstr(syspath, SYSFS_MACHINECHECK) != NULL);
+    }
+
+    void PowerManagement::ACPI::EventSource::readUdev() {
+
+        /* a suspend queues a device per core, take them all */
+        for (;;) {
+
+            if (backlogged()) {
+                return;
+            }
+
+            errno = 0;
+
+            struct udev_device *device = udev_monitor_receive_device(this->udevMonitor);
+
+            const uint64_t now = monotonicNow();
+
+            if (device == NULL) {
+
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+                /* the socket buffer overflowed, the devices in it were lost */
+                if (errno == ENOBUFS) {
+                    fprintf(stderr, "the udev receive buffer overflowed, devices were lost\n");
+                    fanOut([](ACPI *acpi) { count(acpi->counters->udevOverflows); });
+
+                    /* the changes of the cached devices among them */
+                    if (this->cache) {
+                        Hardware::HardwareCache::refresh();
+                    }
+
+                    continue;
+                }
+
+#ifdef DEBUG
+                printf("udev: the device is null\n");
+#endif
+                fanOut([](ACPI *acpi) { count(acpi->counters->udevIgnored); });
+                return;
+            }
+
+            const char *action = udev_device_get_action(device);
+            const char *syspath = udev_device_get_syspath(device);
+            const uint64_t seqnum = udev_device_get_seqnum(device);
+
+            if (action == NULL) action = "";
+            if (syspath == NULL) syspath = "";
+
+            PROBE2(udev_receive, syspath, action);
+
+            /* before the handlers, they may well ask for what changed */
+            if (this->cache) {
+                Hardware::HardwareCache::refresh(syspath);
+            }
+
+            if (udevRelevant(syspath, !this->logind)) {
+                fanOut([action, syspath, seqnum, now](ACPI *acpi) {
+                    acpi->receiveUdevDevice(action, syspath, seqnum, now);
+                });
+            } else {
+                fanOut([](ACPI *acpi) { count(acpi->counters->udevIgnored); });
+            }
+
+            udev_device_unref(device);
+        }
+    }
+
+    bool PowerManagement::ACPI::EventSource::openNetlink() {
+
+        if (this->injectedFd >= 0) {
+            this->kernelFd = fcntl(this->injectedFd, F_DUPFD_CLOEXEC, 0);
+        } else {
+            this->kernelFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+        }
+
+        if (this->kernelFd < 0) {
+            fprintf(stderr, "failed to open the kernel ACPI events: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (this->injectedFd < 0 && !resolveNetlink()) {
+            return false;
+        }
+
+        const int flags = fcntl(this->kernelFd, F_GETFL);
+
+        if (flags < 0 || fcntl(this->kernelFd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+            !reactorWatch(this->epollFd, this->kernelFd, SOURCE_NETLINK)) {
+            fprintf(stderr, "failed to watch the kernel ACPI events: %s\n", strerror(errno));
+            return false;
+        }
+
+#ifdef DEBUG
+
+        printf("starting netlink listener...\n");
+
+#endif
+
+        return true;
+
+    }
+
+    /*
+     * Asks the generic netlink controller for the acpi_event family and
+     * its multicast group and joins the group. The socket is still
+     * blocking, the controller answers right away.
+     */
+    bool PowerManagement::ACPI::EventSource::resolveNetlink() {
+
+        struct {
+            struct nlmsghdr header;
+            struct genlmsghdr genl;
+            char attributes[NLA_ALIGN(NLA_HDRLEN + sizeof(ACPI_GENL_FAMILY_NAME))];
+        } request;
+
+        memset(&request, 0, sizeof(request));
+
+        struct nlattr *name = (struct nlattr*) request.attributes;
+        name->nla_type = CTRL_ATTR_FAMILY_NAME;
+        name->nla_len = NLA_HDRLEN + sizeof(ACPI_GENL_FAMILY_NAME);
+        memcpy(request.attributes + NLA_HDRLEN, ACPI_GENL_FAMILY_NAME, sizeof(ACPI_GENL_FAMILY_NAME));
+
+        request.header.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(name->nla_len));
+        request.header.nlmsg_type = GENL_ID_CTRL;
+        request.header.nlmsg_flags = NLM_F_REQUEST;
+        request.genl.cmd = CTRL_CMD_GETFAMILY;
+        request.genl.version = 1;
+
+        struct sockaddr_nl kernel;
+        memset(&kernel, 0, sizeof(struct sockaddr_nl));
+        kernel.nl_family = AF_NETLINK;
+
+        char reply[NETLINK_BUFSIZE];
+        ssize_t length;
+
+        if (sendto(this->kernelFd, &request, request.header.nlmsg_len, 0,
+                   (struct sockaddr*) &kernel, sizeof(struct sockaddr_nl)) < 0) {
+            fprintf(stderr, "failed to ask for the kernel ACPI events: %s\n", strerror(errno));
+            return false;
+        }
+
+        do {
+            length = recv(this->kernelFd, reply, sizeof(reply), 0);
+        } while (length < 0 && errno == EINTR);
+
+        const struct nlmsghdr *message = (const struct nlmsghdr*) reply;
+
+        if (length < 0 || !NLMSG_OK(message, (int) length) || message->nlmsg_type != GENL_ID_CTRL ||
+            message->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+            fprintf(stderr, "the kernel has no ACPI events, is CONFIG_ACPI enabled?\n");
+            return false;
+        }
+
+        uint32_t group = 0;
+        bool grouped = false;
+
+        netlinkAttributes((const char*) NLMSG_DATA(message) + GENL_HDRLEN,
+                          message->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                          [this, &group, &grouped](int type, const char *data, size_t size) {
+
+            if (type == CTRL_ATTR_FAMILY_ID && size >= sizeof(uint16_t)) {
+                memcpy(&this->genlFamily, data, sizeof(uint16_t));
+            }
+
+            if (type != CTRL_ATTR_MCAST_GROUPS) return;
+
+            /* a nested attribute per group, each with a name and an id */
+            netlinkAttributes(data, size, [&group, &grouped](int, const char *data, size_t size) {
+
+                const char *name = nullptr;
+                uint32_t id = 0;
+
+                netlinkAttributes(data, size, [&name, &id](int type, const char *data, size_t size) {
+                    if (type == CTRL_ATTR_MCAST_GRP_NAME && size > 0 && data[size - 1] == '\0') name = data;
+                    if (type == CTRL_ATTR_MCAST_GRP_ID && size >= sizeof(uint32_t)) memcpy(&id, data, sizeof(uint32_t));
+                });
+
+                if (name != nullptr && strcmp(name, ACPI_GENL_MCAST_GROUP_NAME) == 0) {
+                    group = id;
+                    grouped = true;
+                }
+            });
+        });
+
+        if (this->genlFamily == 0 || !grouped) {
+            fprintf(stderr, "the kernel has no ACPI event group\n");
+            return false;
+        }
+
+        if (setsockopt(this->kernelFd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+            fprintf(stderr, "failed to join the kernel ACPI events: %s\n", strerror(errno));
+            return false;
+        }
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readNetlink() {
+
+        /* a netlink message never spans two reads */
+        char buffer[NETLINK_BUFSIZE];
+
+        for (;;) {
+
+            if (backlogged()) {
+                return;
+            }
+
+            ssize_t length = recv(this->kernelFd, buffer, sizeof(buffer), 0);
+
+            if (length < 0 && errno == EINTR) continue;
+            if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+            /* the socket buffer overflowed, the events in it were lost */
+            if (length < 0 && errno == ENOBUFS) {
+                fprintf(stderr, "the kernel dropped ACPI events\n");
+                continue;
+            }
+
+            if (length <= 0) {
+                fprintf(stderr, "lost the kernel ACPI events: %s\n", length < 0 ? strerror(errno) : "closed");
+                close(this->kernelFd);
+                this->kernelFd = -1;
+                return;
+            }
+
+            const uint64_t now = monotonicNow();
+
+            int remaining = (int) length;
+
+            for (const struct nlmsghdr *message = (const struct nlmsghdr*) buffer; NLMSG_OK(message, remaining);
+                 message = NLMSG_NEXT(message, remaining)) {
+
+                /* the control messages are below NLMSG_MIN_TYPE */
+                if (message->nlmsg_type < NLMSG_MIN_TYPE) continue;
+                if (this->genlFamily != 0 && message->nlmsg_type != this->genlFamily) continue;
+                if (message->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) continue;
+
+                const struct genlmsghdr *genl = (const struct genlmsghdr*) NLMSG_DATA(message);
+
+                if (genl->cmd != ACPI_GENL_CMD_EVENT) continue;
+
+                KernelEvent event;
+                bool found = false;
+
+                netlinkAttributes((const char*) genl + GENL_HDRLEN, message->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                                  [&event, &found](int type, const char *data, size_t size) {
+                    if (type == ACPI_GENL_ATTR_EVENT && size >= sizeof(KernelEvent)) {
+                        memcpy(&event, data, sizeof(KernelEvent));
+                        found = true;
+                    }
+                });
+
+                if (!found) continue;
+
+                event.deviceClass[sizeof(event.deviceClass) - 1] = '\0';
+                event.busId[sizeof(event.busId) - 1] = '\0';
+
+                PROBE2(netlink_receive, event.deviceClass, event.data);
+
+                fanOut([&event, now](ACPI *acpi) {
+                    acpi->receiveKernelEvent(event, now);
+                });
+            }
+        }
+    }
+
+    /*
+     * Opens the event nodes of the input devices with hotkeys, or takes
+     * the files handed to setInputSource instead
+     */
+    bool PowerManagement::ACPI::EventSource::openInput() {
+
+        this->inputEpollFd = epoll_create1(EPOLL_CLOEXEC);
+
+        if (this->inputEpollFd < 0 || !reactorWatch(this->epollFd, this->inputEpollFd, SOURCE_INPUT)) {
+            fprintf(stderr, "failed to watch the input devices: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (!this->injectedInputs.empty()) {
+
+            for (int fd : this->injectedInputs) {
+                addInputDevice(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+            }
+
+            return true;
+        }
+
+        struct udev_enumerate *enumerate = udev_enumerate_new(this->udev);
+
+        udev_enumerate_add_match_subsystem(enumerate, "input");
+        udev_enumerate_scan_devices(enumerate);
+
+        struct udev_list_entry *entry;
+
+        udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+
+            struct udev_device *device = udev_device_new_from_syspath(this->udev, udev_list_entry_get_name(entry));
+
+            if (device == NULL) continue;
+
+            /* the name is on the input device, the event node is its child */
+            const char *sysname = udev_device_get_sysname(device);
+            const char *devnode = udev_device_get_devnode(device);
+            struct udev_device *parent = udev_device_get_parent(device);
+            const char *name = parent != NULL ? udev_device_get_sysattr_value(parent, "name") : NULL;
+
+            if (sysname != NULL && strncmp(sysname, "event", 5) == 0 && devnode != NULL &&
+                name != NULL && isHotkeyDevice(name)) {
+
+                int fd = ::open(devnode, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+                if (fd < 0) {
+                    fprintf(stderr, "failed to open %s (%s): %s\n", devnode, name, strerror(errno));
+                } else {
+#ifdef DEBUG
+                    printf("reading the hotkeys of %s (%s)\n", devnode, name);
+#endif
+                    addInputDevice(fd);
+                }
+            }
+
+            udev_device_unref(device);
+        }
+
+        udev_enumerate_unref(enumerate);
+
+        if (this->inputDevices.empty()) {
+            fprintf(stderr, "no input devices with hotkeys to read\n");
+        }
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::addInputDevice(int fd) {
+
+        const int flags = fd >= 0 ? fcntl(fd, F_GETFL) : -1;
+
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+            !reactorWatch(this->inputEpollFd, fd, this->inputDevices.size())) {
+            fprintf(stderr, "failed to watch an input device: %s\n", strerror(errno));
+            if (fd >= 0) close(fd);
+            return;
+        }
+
+        InputDevice device;
+        device.fd = fd;
+        device.pending = 0;
+
+        this->inputDevices.push_back(device);
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readInput() {
+
+        struct epoll_event ready[8];
+
+        const int count = epoll_wait(this->inputEpollFd, ready, 8, 0);
+
+        for (int i = 0; i < count; i++) {
+
+            InputDevice &device = this->inputDevices[ready[i].data.u64];
+
+            if (device.fd >= 0) readInputDevice(device);
+        }
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readInputDevice(InputDevice &device) {
+
+        struct input_event events[INPUT_BATCH];
+        char *buffer = (char*) events;
+
+        for (;;) {
+
+            if (backlogged()) {
+                return;
+            }
+
+            /* an event device only hands out whole events, a pipe may not */
+            memcpy(buffer, device.partial, device.pending);
+
+            ssize_t length = read(device.fd, buffer + device.pending, sizeof(events) - device.pending);
+
+            if (length < 0 && errno == EINTR) continue;
+            if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+            if (length <= 0) {
+                fprintf(stderr, "lost an input device: %s\n", length < 0 ? strerror(errno) : "closed");
+                close(device.fd);
+                device.fd = -1;
+                return;
+            }
+
+            const uint64_t now = monotonicNow();
+
+            const size_t total = device.pending + length;
+            const size_t whole = total / sizeof(struct input_event);
+
+            for (size_t i = 0; i < whole; i++) {
+
+                /* presses only, not the releases and the repeats */
+                if (events[i].type != EV_KEY || events[i].value != 1) continue;
+
+                const uint16_t code = events[i].code;
+
+                if (classifyInputKey(code) == ACPIEvent::UNKNOWN) continue;
+
+                PROBE1(input_receive, code);
+
+                fanOut([code, now](ACPI *acpi) {
+                    acpi->receiveInputKey(code, now);
+                });
+            }
+
+            device.pending = total - whole * sizeof(struct input_event);
+            memcpy(device.partial, buffer + whole * sizeof(struct input_event), device.pending);
+        }
+    }
+
+    bool PowerManagement::ACPI::EventSource::openLogind() {
+
+#ifdef SYSTEMD
+
+        this->busTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (this->busTimerFd < 0 || !reactorWatch(this->epollFd, this->busTimerFd, SOURCE_BUS_TIMER)) {
+            fprintf(stderr, "failed to set up the system bus timer: %s\n", strerror(errno));
+            return false;
+        }
+
+        /* the first connection is made or start() fails, later ones are retried */
+        if (!connectBus(true)) {
+            return false;
+        }
+
+#ifdef DEBUG
+
+        printf("starting logind listener...\n");
+
+#endif
+
+        return true;
+
+#else
+
+        fprintf(stderr, "logind needs a build with systemd\n");
+        return false;
+
+#endif
+
+    }
+
+#ifdef SYSTEMD
+
+    /*
+     * Connects to the system bus and listens for PrepareForSleep. With
+     * wait, the delay lock is taken before it returns, else its reply
+     * is handled by the reactor.
+     */
+    bool PowerManagement::ACPI::EventSource::connectBus(bool wait) {
+
+        int status = sd_bus_open_system(&this->bus);
+
+        if (status < 0) {
+            fprintf(stderr, "failed to connect to the system bus: %s\n", strerror(-status));
+            this->bus = nullptr;
+            return false;
+        }
+
+        status = sd_bus_match_signal(this->bus, &this->sleepSlot,
+                                     "org.freedesktop.login1",
+                                     "/org/freedesktop/login1",
+                                     "org.freedesktop.login1.Manager",
+                                     "PrepareForSleep",
+                                     prepareForSleep, this);
+
+        if (status < 0) {
+            fprintf(stderr, "failed to listen for PrepareForSleep: %s\n", strerror(-status));
+            closeBus();
+            return false;
+        }
+
+        pthread_mutex_lock(&this->sleepLock);
+        const bool inhibiting = this->delay && this->inhibitFd < 0;
+        pthread_mutex_unlock(&this->sleepLock);
+
+        /* a lock taken before the bus was lost is still held */
+        if (inhibiting && !inhibit(wait)) {
+            closeBus();
+            return false;
+        }
+
+        if (!reactorWatch(this->epollFd, sd_bus_get_fd(this->bus), SOURCE_LOGIND)) {
+            fprintf(stderr, "failed to watch the system bus: %s\n", strerror(errno));
+            closeBus();
+            return false;
+        }
+
+        this->busBackoff = ACPID_RECONNECT_MIN;
+
+        watchBus();
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::closeBus() {
+
+        epoll_ctl(this->epollFd, EPOLL_CTL_DEL, sd_bus_get_fd(this->bus), NULL);
+
+        this->sleepSlot = sd_bus_slot_unref(this->sleepSlot);
+
+        pthread_mutex_lock(&this->sleepLock);
+        this->inhibitSlot = sd_bus_slot_unref(this->inhibitSlot);
+        pthread_mutex_unlock(&this->sleepLock);
+
+        this->bus = sd_bus_flush_close_unref(this->bus);
+
+    }
+
+    /* like acpid, the bus is connected again with a growing backoff */
+    void PowerManagement::ACPI::EventSource::retryBus() {
+
+        printf("Connecting to the system bus again in %u ms\n", this->busBackoff);
+
+        struct itimerspec retry;
+        memset(&retry, 0, sizeof(struct itimerspec));
+
+        retry.it_value.tv_sec = this->busBackoff / 1000;
+        retry.it_value.tv_nsec = (long) (this->busBackoff % 1000) * 1000000l;
+
+        timerfd_settime(this->busTimerFd, 0, &retry, NULL);
+
+        this->busBackoff = std::min(this->busBackoff * 2, (unsigned int) ACPID_RECONNECT_MAX);
+
+    }
+
+    /* sd-bus may have something to write as well, or a reply to time out */
+    void PowerManagement::ACPI::EventSource::watchBus() {
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+
+        const int events = sd_bus_get_events(this->bus);
+
+        event.events = (events & POLLOUT) != 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.u64 = SOURCE_LOGIND;
+
+        epoll_ctl(this->epollFd, EPOLL_CTL_MOD, sd_bus_get_fd(this->bus), &event);
+
+        uint64_t timeout;
+
+        struct itimerspec due;
+        memset(&due, 0, sizeof(struct itimerspec));
+
+        /* a CLOCK_MONOTONIC time in microseconds, 0 for right away */
+        if (sd_bus_get_timeout(this->bus, &timeout) > 0 && timeout != UINT64_MAX) {
+            due.it_value.tv_sec = timeout / 1000000;
+            due.it_value.tv_nsec = (long) (timeout % 1000000) * 1000l;
+
+            /* a zero it_value disarms the timer */
+            if (timeout == 0) due.it_value.tv_nsec = 1;
+        }
+
+        timerfd_settime(this->busTimerFd, TFD_TIMER_ABSTIME, &due, NULL);
+
+    }
+
+    int PowerManagement::ACPI::EventSource::prepareForSleep(sd_bus_message *message, void *_this, sd_bus_error*) {
+
+        EventSource *source = (EventSource*) _this;
+
+        const uint64_t now = monotonicNow();
+
+        int entering;
+
+        if (sd_bus_message_read(message, "b", &entering) < 0) {
+            fprintf(stderr, "PrepareForSleep without its argument\n");
+            return 0;
+        }
+
+        PROBE1(logind_receive, entering);
+
+        if (source->delay) {
+
+            pthread_mutex_lock(&source->sleepLock);
+
+            source->sleepPending.clear();
+
+            if (entering) {
+
+                /* each of them lets go once its handlers are done */
+                source->sleepPending = source->subscribers;
+
+                if (source->sleepPending.empty() && source->inhibitFd >= 0) {
+                    close(source->inhibitFd);
+                    source->inhibitFd = -1;
+                }
+            }
+
+            const bool inhibiting = !entering && source->inhibitFd < 0 && source->inhibitSlot == nullptr;
+
+            pthread_mutex_unlock(&source->sleepLock);
+
+            /* for the next sleep, without waiting for logind */
+            if (inhibiting) {
+                source->inhibit(false);
+            }
+        }
+
+        source->fanOut([entering, now](ACPI *acpi) {
+            acpi->receiveSleepSignal(entering != 0, now);
+        });
+
+        return 0;
+
+    }
+
+    /*
+     * Takes a delay inhibitor lock for the sleep from logind. The lock
+     * is held for as long as its file descriptor is open.
+     */
+    bool PowerManagement::ACPI::EventSource::inhibit(bool wait) {
+
+        int status;
+
+        if (wait) {
+
+            sd_bus_error error = SD_BUS_ERROR_NULL;
+            sd_bus_message *reply = nullptr;
+
+            status = sd_bus_call_method(this->bus,
+                                        "org.freedesktop.login1",
+                                        "/org/freedesktop/login1",
+                                        "org.freedesktop.login1.Manager",
+                                        "Inhibit",
+                                        &error,
+                                        &reply,
+                                        "ssss",
+                                        "sleep",
+                                        "libthinkpad",
+                                        "Running the pre-sleep handlers",
+                                        "delay");
+
+            if (status < 0) {
+                fprintf(stderr, "failed to take the sleep delay lock: %s\n",
+                        error.message != NULL ? error.message : strerror(-status));
+                sd_bus_error_free(&error);
+                return false;
+            }
+
+            inhibited(reply);
+
+            sd_bus_message_unref(reply);
+            sd_bus_error_free(&error);
+
+            return true;
+        }
+
+        status = sd_bus_call_method_async(this->bus,
+                                          &this->inhibitSlot,
+                                          "org.freedesktop.login1",
+                                          "/org/freedesktop/login1",
+                                          "org.freedesktop.login1.Manager",
+                                          "Inhibit",
+                                          inhibitReplied,
+                                          this,
+                                          "ssss",
+                                          "sleep",
+                                          "libthinkpad",
+                                          "Running the pre-sleep handlers",
+                                          "delay");
+
+        if (status < 0) {
+            fprintf(stderr, "failed to take the sleep delay lock: %s\n", strerror(-status));
+            return false;
+        }
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::inhibited(sd_bus_message *reply) {
+
+        int fd;
+
+        if (sd_bus_message_read(reply, "h", &fd) < 0) {
+            fprintf(stderr, "logind gave no sleep delay lock\n");
+            return;
+        }
+
+        /* the reply owns the descriptor */
+        fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+
+        if (fd < 0) {
+            fprintf(stderr, "failed to keep the sleep delay lock: %s\n", strerror(errno));
+            return;
+        }
+
+        pthread_mutex_lock(&this->sleepLock);
+
+        if (this->inhibitFd >= 0) close(this->inhibitFd);
+        this->inhibitFd = fd;
+
+        pthread_mutex_unlock(&this->sleepLock);
+
+    }
+
+    int PowerManagement::ACPI::EventSource::inhibitReplied(sd_bus_message *reply, void *_this, sd_bus_error*) {
+
+        EventSource *source = (EventSource*) _this;
+
+        pthread_mutex_lock(&source->sleepLock);
+        source->inhibitSlot = sd_bus_slot_unref(source->inhibitSlot);
+        pthread_mutex_unlock(&source->sleepLock);
+
+        if (sd_bus_message_is_method_error(reply, NULL)) {
+            const sd_bus_error *error = sd_bus_message_get_error(reply);
+            fprintf(stderr, "failed to take the sleep delay lock: %s\n", error->message);
+            return 0;
+        }
+
+        source->inhibited(reply);
+
+        return 0;
+
+    }
+
+#endif
+
+    /* an instance is done with its pre-sleep handlers, the last one lets the system sleep */
+    void PowerManagement::ACPI::EventSource::preSleepDone(ACPI *acpi) {
+
+        pthread_mutex_lock(&this->sleepLock);
+
+        auto pending = std::find(this->sleepPending.begin(), this->sleepPending.end(), acpi);
+
+        if (pending != this->sleepPending.end()) {
+
+            this->sleepPending.erase(pending);
+
+            if (this->sleepPending.empty() && this->inhibitFd >= 0) {
+                close(this->inhibitFd);
+                this->inhibitFd = -1;
+            }
+        }
+
+        pthread_mutex_unlock(&this->sleepLock);
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readLogind() {
+
+#ifdef SYSTEMD
+
+        /* lost in an earlier event of the same wakeup */
+        if (this->bus == nullptr) return;
+
+        int status;
+
+        /* one message each time, the signal handler runs from here */
+        while ((status = sd_bus_process(this->bus, NULL)) > 0);
+
+        if (status < 0) {
+            fprintf(stderr, "lost the system bus: %s\n", strerror(-status));
+            closeBus();
+            retryBus();
+            return;
+        }
+
+        watchBus();
+
+#endif
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readBusTimer() {
+
+#ifdef SYSTEMD
+
+        uint64_t expirations;
+
+        if (read(this->busTimerFd, &expirations, sizeof(expirations)) <= 0) {
+            return;
+        }
+
+        /* sd-bus times out what it waits for from process() */
+        if (this->bus != nullptr) {
+            readLogind();
+            return;
+        }
+
+        if (!connectBus(false)) {
+            retryBus();
+        }
+
+#endif
+
+    }
+
+    bool PowerManagement::ACPI::EventSource::openCache() {
+
+        this->cacheFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        struct itimerspec tick;
+        tick.it_interval.tv_sec = ACPI_CACHE_STALENESS / 2 / 1000;
+        tick.it_interval.tv_nsec = (long) (ACPI_CACHE_STALENESS / 2 % 1000) * 1000000;
+        tick.it_value = tick.it_interval;
+
+        if (this->cacheFd < 0 || timerfd_settime(this->cacheFd, 0, &tick, NULL) < 0 ||
+            !reactorWatch(this->epollFd, this->cacheFd, SOURCE_CACHE)) {
+            fprintf(stderr, "failed to set up the hardware cache: %s\n", strerror(errno));
+
+            if (this->cacheFd >= 0) close(this->cacheFd);
+            this->cacheFd = -1;
+
+            return false;
+        }
+
+        Hardware::HardwareCache::attach();
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::EventSource::readCache() {
+
+        uint64_t expirations;
+
+        if (read(this->cacheFd, &expirations, sizeof(expirations)) <= 0) {
+            return;
+        }
+
+        /* now and then everything, in case udev lost a change */
+        if (++this->cacheTicks >= ACPI_CACHE_RESYNC / (ACPI_CACHE_STALENESS / 2)) {
+            this->cacheTicks = 0;
+            Hardware::HardwareCache::refresh();
+        } else {
+            Hardware::HardwareCache::tick();
+        }
+
+    }
+
+    void PowerManagement::ACPI::EventSource::handle(struct epoll_event *events, int count) {
+
+        pthread_mutex_lock(&this->lock);
+
+        for (int i = 0; i < count; i++) {
+
+            const uint64_t data = events[i].data.u64;
+
+            if (data >= SOURCE_COUNT) {
+
+                ACPI *acpi = (ACPI*) (uintptr_t) data;
+
+                /* it may have stopped listening since the wait */
+                if (subscribed(acpi)) acpi->runTimers();
+
+                continue;
+            }
+
+            switch (data) {
+
+                case SOURCE_WAKE:
+                    break;
+
+                case SOURCE_RECONNECT: {
+                    uint64_t expirations;
+
+                    if (read(this->reconnectFd, &expirations, sizeof(expirations)) > 0) {
+                        connectAcpid();
+                    }
+
+                    break;
+                }
+
+                case SOURCE_ACPID:
+                    /* an earlier event may have reconnected meanwhile */
+                    if (this->acpidFd >= 0) readAcpid();
+                    break;
+
+                case SOURCE_UDEV:
+                    readUdev();
+                    break;
+
+                case SOURCE_NETLINK:
+                    if (this->kernelFd >= 0) readNetlink();
+                    break;
+
+                case SOURCE_INPUT:
+                    readInput();
+                    break;
+
+                case SOURCE_LOGIND:
+                    readLogind();
+                    break;
+
+                case SOURCE_CACHE:
+                    readCache();
+                    break;
+
+                case SOURCE_BUS_TIMER:
+                    readBusTimer();
+                    break;
+            }
+        }
+
+        pthread_mutex_unlock(&this->lock);
+
+    }
+
+    void PowerManagement::ACPI::EventSource::poll() {
+
+        struct epoll_event events[8];
+
+        int count;
+
+        /* the sources are level triggered, whatever is left is seen next time */
+        do {
+            count = epoll_wait(this->epollFd, events, 8, 0);
+        } while (count < 0 && errno == EINTR);
+
+        if (count > 0) {
+            handle(events, count);
+        }
+
+    }
+
+    void *PowerManagement::ACPI::EventSource::reactor(void *_this) {
+
+        EventSource *source = (EventSource*) _this;
+
+        struct epoll_event events[8];
+
+        while (!source->stopping) {
+
+            int count = epoll_wait(source->epollFd, events, 8, -1);
+
+            if (count < 0) {
+
+                if (errno == EINTR) continue;
+
+                fprintf(stderr, "ACPI event loop failed: %s\n", strerror(errno));
+                break;
+            }
+
+            source->handle(events, count);
+        }
+
+        /* nothing comes in anymore, let whoever waits go */
+        if (!source->stopping) {
+
+            pthread_mutex_lock(&source->lock);
+
+            source->fanOut([](ACPI *acpi) {
+                pthread_mutex_lock(&acpi->listenLock);
+                acpi->listening = false;
+                pthread_cond_broadcast(&acpi->listenDone);
+                pthread_mutex_unlock(&acpi->listenLock);
+            });
+
+            pthread_mutex_unlock(&source->lock);
+        }
+
+        return nullptr;
+
+    }
+
+    void PowerManagement::ACPI::receiveAcpidLine(const char *line, size_t length, uint64_t now) {
+
+        if (this->recordFd.load(std::memory_order_relaxed) >= 0) {
+            record(RECORD_ACPID, now, 0, line, length, nullptr, 0);
+        }
+
+        EventTimes times = { this->statsEnabled.load(std::memory_order_relaxed) ? now : 0, 0, 0 };
+
+        handleAcpidLine(line, length, times);
+
+    }
+
+    void PowerManagement::ACPI::receiveUdevDevice(const char *action, const char *syspath,
+                                                  uint64_t seqnum, uint64_t now) {
+
+        if (this->recordFd.load(std::memory_order_relaxed) >= 0) {
+            record(RECORD_UDEV, now, seqnum, action, strlen(action) + 1, syspath, strlen(syspath) + 1);
+        }
+
+        EventTimes times = { this->statsEnabled.load(std::memory_order_relaxed) ? now : 0, 0, 0 };
+
+        handleUdevDevice(action, syspath, times);
+
+    }
+
+    void PowerManagement::ACPI::receiveKernelEvent(const KernelEvent &event, uint64_t now) {
+
+        static_assert(sizeof(KernelEvent) == 44, "the kernel sends a 44 byte acpi_genl_event");
+
+        if (this->recordFd.load(std::memory_order_relaxed) >= 0) {
+            record(RECORD_NETLINK, now, 0, (const char*) &event, sizeof(KernelEvent), nullptr, 0);
+        }
+
+        EventTimes times = { this->statsEnabled.load(std::memory_order_relaxed) ? now : 0, 0, 0 };
+
+        handleKernelEvent(event, times);
+
+    }
+
+    void PowerManagement::ACPI::receiveInputKey(uint16_t code, uint64_t now) {
+
+        if (this->recordFd.load(std::memory_order_relaxed) >= 0) {
+            record(RECORD_INPUT, now, 0, (const char*) &code, sizeof(uint16_t), nullptr, 0);
+        }
+
+        EventTimes times = { this->statsEnabled.load(std::memory_order_relaxed) ? now : 0, 0, 0 };
+
+        handleInputKey(code, times);
+
+    }
+
+    void PowerManagement::ACPI::receiveSleepSignal(bool entering, uint64_t now) {
+
+        if (this->recordFd.load(std::memory_order_relaxed) >= 0) {
+            const uint8_t argument = entering ? 1 : 0;
+            record(RECORD_LOGIND, now, 0, (const char*) &argument, sizeof(uint8_t), nullptr, 0);
+        }
+
+        const bool holding = this->source->delay;
+
+        if (holding && entering) {
+            beginPreSleep(now);
+        }
+
+        EventTimes times = { this->statsEnabled.load(std::memory_order_relaxed) ? now : 0, 0, 0 };
+
+        handleSleepSignal(entering, times);
+
+        if (!holding) return;
+
+        /*
+         * Without handlers for it the round is over already. After the
+         * resume a round still running has missed the sleep anyway.
+         */
+        pthread_mutex_lock(&this->dispatchLock);
+
+        ACPIPreSleepReport report;
+        const bool finished = (!entering || (this->preSleepDispatched && this->preSleepPending == 0)) &&
+                              finishPreSleep(!entering, report);
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (finished) {
+            reportPreSleep(report);
+        }
+
+    }
+
+    void PowerManagement::ACPI::record(uint8_t source, uint64_t time, uint64_t seqnum,
+                                       const char *first, size_t firstLength,
+                                       const char *second, size_t secondLength) {
+
+        RecordHeader header;
+        memset(&header, 0, sizeof(RecordHeader));
+
+        const size_t seqnumLength = source == RECORD_UDEV ? sizeof(uint64_t) : 0;
+        const size_t length = seqnumLength + firstLength + secondLength;
+
+        if (length > UINT16_MAX) return;
+
+        header.time = time;
+        header.length = (uint16_t) length;
+        header.source = source;
+
+        /* one write per record, so a record is never torn by another */
+        struct iovec parts[4] = {
+            { &header, sizeof(RecordHeader) },
+            { &seqnum, seqnumLength },
+            { (void*) first, firstLength },
+            { (void*) second, secondLength }
+        };
+
+        pthread_mutex_lock(&this->recordLock);
+
+        const int fd = this->recordFd.load(std::memory_order_relaxed);
+
+        if (fd >= 0 && writev(fd, parts, 4) != (ssize_t) (sizeof(RecordHeader) + length)) {
+            fprintf(stderr, "failed to record an event, recording stopped: %s\n", strerror(errno));
+            close(fd);
+            this->recordFd = -1;
+        }
+
+        pthread_mutex_unlock(&this->recordLock);
+
+    }
+
+    void PowerManagement::ACPI::recordState(ACPIEvent event) {
+
+        if (this->recordFd.load(std::memory_order_relaxed) < 0) return;
+
+        const uint8_t state = (uint8_t) event;
+        record(RECORD_STATE, monotonicNow(), 0, (const char*) &state, sizeof(uint8_t), nullptr, 0);
+
+    }
+
+    void PowerManagement::ACPI::handleAcpidLine(const char *line, size_t length, EventTimes times) {
+
+        PROBE2(acpid_receive, line, length);
+
+        const ACPIEvent event = classifyAcpid(line);
+        classifiedNow(times);
+
+        PROBE2(acpid_classify, (int) event, line);
+
+        if (event == ACPIEvent::UNKNOWN) {
+            count(this->counters->unknownLines);
+        }
+
+        emit(event, times);
+
+    }
+
+    void PowerManagement::ACPI::handleKernelEvent(const KernelEvent &kernel, EventTimes times) {
+
+        ACPIEvent event = ACPIEvent::UNKNOWN;
+
+        if (strcmp(kernel.deviceClass, "button/power") == 0) {
+            event = ACPIEvent::BUTTON_POWER;
+        } else if (strcmp(kernel.deviceClass, "button/sleep") == 0) {
+            event = ACPIEvent::BUTTON_FNF4_SLEEP;
+        } else if (strcmp(kernel.deviceClass, "button/lid") == 0) {
+            event = lidState();
+            recordState(event);
+        } else if (strcmp(kernel.deviceClass, "ibm/hotkey") == 0) {
+
+            if (kernel.data == TPACPI_HKEY_DOCKED) {
+                event = ACPIEvent::DOCKED;
+            } else if (kernel.data == TPACPI_HKEY_UNDOCKED) {
+                event = ACPIEvent::UNDOCKED;
+            }
+        }
+
+        classifiedNow(times);
+
+        PROBE2(netlink_classify, (int) event, kernel.deviceClass);
+
+        if (event == ACPIEvent::UNKNOWN) {
+            count(this->counters->unknownLines);
+        }
+
+        emit(event, times);
+
+    }
+
+    void PowerManagement::ACPI::handleInputKey(uint16_t code, EventTimes times) {
+
+        const ACPIEvent event = classifyInputKey(code);
+        classifiedNow(times);
+
+        PROBE2(input_classify, (int) event, code);
+
+        emit(event, times);
+
+    }
+
+    void PowerManagement::ACPI::handleSleepSignal(bool entering, EventTimes times) {
+
+        /* logind says it once, no per core debouncing */
+        this->enteringS3S4 = entering;
+
+        const ACPIEvent event = entering ? ACPIEvent::POWER_S3S4_ENTER : ACPIEvent::POWER_S3S4_EXIT;
+        classifiedNow(times);
+
+        PROBE2(logind_classify, (int) event, entering);
+
+        emit(event, times);
+
+    }
+
+    void PowerManagement::ACPI::handleUdevDevice(const char *action, const char *syspath, EventTimes times) {
+
+        ACPIEvent event = ACPIEvent::UNKNOWN;
+
+        /*
+         * The /sys/devices/platform/dock.2 path is the main ThinkPad
+         * dock device file on XX20 series ThinkPads, other ThinkPads
+         * have not been tested as I don't have the hardware to test.
+         */
+        if (strstr(syspath, IBM_DOCK) != NULL) {
+
+            /*
+             * One could argue that I can use this instead of reading the
+             * file manually but this just plainly does not work, it returns
+             * what it feels like of returning
+             */
+            // const char *docked = udev_device_get_sysattr_value(device, "docked");
+
+            Hardware::Dock dock;
+
+            if (!dock.probe()) {
+                fprintf(stderr, "fixme: udev event fired on non-sane dock\n");
+                count(this->counters->udevIgnored);
+                return;
+            }
+
+            /*
+             * The dock reports itself several times and needs a
+             * moment to appear, so its state is read once it
+             * settled. Reports until then are covered by that read.
+             */
+            if (!this->dockSettling.exchange(true)) {
+                classifiedNow(times);
+                this->dockTimes = times;
+                scheduleTimer(ACPI_DOCK_SETTLE, [this]() { dockSettled(); });
+            }
+
+            return;
+
+        }
+
+        /*
+         * When the system is suspending, Linux switches off all CPU cores
+         * but one, and this change is reflected in the sysfs with the
+         * removal/addition of the machinecheck files. We intercept these
+         * changes and act upon them
+         */
+        if (strstr(syspath, SYSFS_MACHINECHECK) != NULL) {
+
+            if (strcmp(action, "remove") == 0) {
+
+                /**
+                 * Each core except for CPU0 is brought down
+                 * and then up again, we debounce this with
+                 * only one event.
+                 */
+                if (this->enteringS3S4.exchange(true)) {
+                    count(this->counters->udevIgnored);
+                    return;
+                }
+
+                event = ACPIEvent::POWER_S3S4_ENTER;
+            }
+
+            if (strcmp(action, "add") == 0) {
+
+                if (!this->enteringS3S4.exchange(false)) {
+                    count(this->counters->udevIgnored);
+                    return;
+                }
+
+                event = ACPIEvent::POWER_S3S4_EXIT;
+            }
+
+        }
+
+        classifiedNow(times);
+
+        PROBE2(udev_classify, (int) event, syspath);
+
+        emit(event, times);
+
+    }
+
+    void PowerManagement::ACPI::stopListening() {
+
+        if (this->source == nullptr) return;
+
+        /* no round begins after this, one still running lets go of the source */
+        this->source->unsubscribe(this);
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        ACPIPreSleepReport report;
+        this->preSleepSource = nullptr;
+        const bool finished = finishPreSleep(true, report);
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (finished) {
+            reportPreSleep(report);
+        }
+
+        if (this->source->threaded) {
+            EventSource::release(this->source);
+        } else {
+            delete this->source;
+        }
+
+        this->source = nullptr;
+
+        pthread_mutex_lock(&this->listenLock);
+        this->listening = false;
+        pthread_cond_broadcast(&this->listenDone);
+        pthread_mutex_unlock(&this->listenLock);
+
+    }
+
+    int PowerManagement::ACPI::startPolling() {
+
+        if (this->source != nullptr) {
+            fprintf(stderr, "the ACPI events are already being listened on\n");
+            return -1;
+        }
+
+        if (this->ring == nullptr) {
+            this->ring = new PollRing;
+        }
+
+        EventSource *source = new EventSource(this, false);
+
+        if (!source->open()) {
+            delete source;
+            return -1;
+        }
+
+        this->polling = true;
+        this->source = source;
+        this->listening = true;
+
+        source->subscribe(this);
+
+        return source->epollFd;
+
+    }
+
+    size_t PowerManagement::ACPI::process() {
+
+        if (this->source != nullptr) {
+            this->source->poll();
+        }
+
+        return this->ring != nullptr ? this->ring->size() : 0;
+
+    }
+
+    bool PowerManagement::ACPI::tryPop(ACPIEvent &event) {
+        return this->ring != nullptr && this->ring->pop(&event, 1) == 1;
+    }
+
+    size_t PowerManagement::ACPI::drain(ACPIEvent *events, size_t max) {
+        return this->ring != nullptr ? this->ring->pop(events, max) : 0;
+    }
+
+    /*
+     * A registered handler. Entries are shared between handler tables and
+     * freed by the writer that removes them, after the last invocation
+     * has finished.
+     */
+    struct PowerManagement::ACPI::HandlerEntry {
+
+        ACPICallback *callback;
+        ACPIEventHandler *handler;
+        ACPIHandlerId id;
+        ACPIEventMask mask;
+        ACPIDispatchMode mode;
+
+        /*
+         * The events queued for this handler, a ring buffer allocated
+         * once when the handler is added. Guarded by the dispatch lock,
+         * like everything below.
+         */
+        struct QueuedEvent {
+            ACPIEvent event;
+            unsigned int repeat;
+
+            /* for the statistics, 0 while they are disabled */
+            uint64_t received;
+            uint64_t enqueued;
+        } queue[ACPI_HANDLER_QUEUE];
+        unsigned int queueHead;
+        unsigned int queueLength;
+
+        /* in the ready list, waiting for a worker */
+        bool ready;
+        HandlerEntry *nextReady;
+
+        /* a serial handler is being run by a worker */
+        bool running;
+
+        /* queued and running invocations */
+        unsigned int inflight;
+
+        /* removed from inside itself, the invocation frees the entry */
+        bool released;
+
+        /* the watchdog budget in milliseconds, 0 when unwatched */
+        unsigned int budget;
+
+        /* overruns in a row, and whether that got it quarantined */
+        unsigned int overruns;
+        bool quarantined;
+
+        ~HandlerEntry() {
+            delete callback;
+        }
+    };
+
+    struct PowerManagement::ACPI::HandlerTable {
+        vector<HandlerEntry*> entries;
+
+        /* the handlers subscribed to each event */
+        vector<HandlerEntry*> subscribers[ACPIEventCount];
+
+        void add(HandlerEntry *entry) {
+            entries.push_back(entry);
+            for (size_t event = 0; event < ACPIEventCount; event++) {
+                if (entry->mask.test(event)) {
+                    subscribers[event].push_back(entry);
+                }
+            }
+        }
+    };
+
+    /*
+     * Calls the virtual handleEvent of an ACPIEventHandler, small
+     * enough to live inside the ACPICallback
+     */
+    struct VirtualHandler {
+        PowerManagement::ACPIEventHandler *handler;
+
+        void operator()(PowerManagement::ACPIEvent event, unsigned int repeat) {
+            if (repeat > 1) {
+                handler->handleRepeatedEvent(event, repeat);
+            } else {
+                handler->handleEvent(event);
+            }
+        }
+    };
+
+    /* the handler the current thread is running, if any */
+    static thread_local const void *currentEntry = nullptr;
+
+    /* the invocation slot of the current thread, if it is a worker */
+    static thread_local const void *currentInvocation = nullptr;
+
+    void *PowerManagement::ACPI::worker(void *_this) {
+
+        ACPI *acpi = (ACPI*) _this;
+
+        pthread_mutex_lock(&acpi->dispatchLock);
+
+        /* the watchdog finds what this worker runs here */
+        const size_t slot = acpi->workerSlots++;
+        Invocation &invocation = acpi->invocations[slot];
+
+        invocation.entry = nullptr;
+        currentInvocation = &invocation;
+
+        while (acpi->workersRunning) {
+
+            HandlerEntry *entry = acpi->readyHead;
+
+            if (entry == nullptr) {
+                pthread_cond_wait(&acpi->workAvailable, &acpi->dispatchLock);
+                continue;
+            }
+
+            acpi->readyHead = entry->nextReady;
+            if (acpi->readyHead == nullptr) {
+                acpi->readyTail = nullptr;
+            }
+
+            entry->ready = false;
+
+            HandlerEntry::QueuedEvent queued = entry->queue[entry->queueHead];
+            entry->queueHead = (entry->queueHead + 1) % ACPI_HANDLER_QUEUE;
+            entry->queueLength--;
+
+            if (entry->mode == DISPATCH_SERIAL) {
+                /* the next event waits until this one is handled */
+                entry->running = true;
+            } else if (entry->queueLength > 0) {
+                /* let another worker take the next event of this handler */
+                acpi->makeReady(entry);
+                pthread_cond_signal(&acpi->workAvailable);
+            }
+
+            const unsigned int budget = entry->budget;
+
+            invocation.entry = entry;
+            invocation.event = queued.event;
+            invocation.started = budget != 0 ? monotonicNow() : 0;
+            invocation.sequence = ++acpi->invocationSequence;
+            invocation.overran = false;
+
+            const uint64_t sequence = invocation.sequence;
+
+            pthread_mutex_unlock(&acpi->dispatchLock);
+
+            ACPITimerId watchdog = 0;
+
+            if (budget != 0) {
+                watchdog = acpi->scheduleTimer(budget, [acpi, slot, sequence]() {
+                    acpi->watchdogExpired(slot, sequence);
+                });
+            }
+
+            const uint64_t start = queued.received != 0 ? monotonicNow() : 0;
+
+            count(acpi->counters->invocations[queued.event]);
+
+            currentEntry = entry;
+            invokeHandler(*entry->callback, entry->id, queued.event, queued.repeat,
+                          acpi->counters->failures[queued.event]);
+            currentEntry = nullptr;
+
+            if (start != 0) {
+                acpi->recordLatency(queued.event, LATENCY_QUEUE, queued.enqueued, start);
+                acpi->recordLatency(queued.event, LATENCY_DELIVERY, queued.received, start);
+                acpi->recordLatency(queued.event, LATENCY_HANDLER, start, monotonicNow());
+            }
+
+            if (watchdog != 0) {
+                acpi->cancelTimer(watchdog);
+            }
+
+            pthread_mutex_lock(&acpi->dispatchLock);
+
+            invocation.entry = nullptr;
+
+            if (budget != 0 && !invocation.overran) {
+                entry->overruns = 0;
+            }
+
+            if (entry->mode == DISPATCH_SERIAL) {
+                entry->running = false;
+                if (entry->queueLength > 0) {
+                    acpi->makeReady(entry);
+                }
+            }
+
+            const bool released = entry->released;
+            entry->inflight--;
+            pthread_cond_broadcast(&acpi->invocationDone);
+
+            /* nothing of it is stuck anymore */
+            if (entry->quarantined && entry->inflight == 0) {
+                fprintf(stderr, "ACPI handler %lu recovered, leaving quarantine\n", entry->id);
+                entry->quarantined = false;
+            }
+
+            ACPIPreSleepReport report;
+            const bool slept = acpi->preSleepHandled(entry, queued.event, report);
+
+            if (released && entry->inflight == 0) {
+                delete entry;
+            }
+
+            /* the last pre-sleep handler, the sleep goes on */
+            if (slept) {
+                pthread_mutex_unlock(&acpi->dispatchLock);
+                acpi->reportPreSleep(report);
+                pthread_mutex_lock(&acpi->dispatchLock);
+            }
+        }
+
+        pthread_mutex_unlock(&acpi->dispatchLock);
+
+        return nullptr;
+    }
+
+    /*
+     * Count an overrun of an entry and quarantine it if it keeps
+     * overrunning. Must be called with the dispatch lock held.
+     */
+    PowerManagement::ACPIOverrun PowerManagement::ACPI::noteOverrun(HandlerEntry *entry, ACPIEvent event,
+                                                                   uint64_t elapsed, bool quarantine) {
+
+        count(this->counters->overruns[event]);
+
+        entry->overruns++;
+
+        if (quarantine && this->quarantineAfter != 0 && entry->overruns >= this->quarantineAfter) {
+            entry->quarantined = true;
+        }
+
+        ACPIOverrun overrun = { entry->id, entry->handler, event, entry->budget, elapsed, entry->quarantined };
+
+        return overrun;
+    }
+
+    void PowerManagement::ACPI::reportOverrun(const ACPIOverrun &overrun) {
+
+        fprintf(stderr, "ACPI handler %lu is handling event %d for %llu ms, over its budget of %u ms%s\n",
+                overrun.id, overrun.event, overrun.elapsed, overrun.budget,
+                overrun.quarantined ? ", quarantined" : "");
+
+        pthread_mutex_lock(&this->dispatchLock);
+        ACPIOverrunCallback callback = this->overrunCallback;
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (callback) {
+            callback(overrun);
+        }
+    }
+
+    /* the budget of an invocation is over, on the event thread */
+    void PowerManagement::ACPI::watchdogExpired(size_t slot, uint64_t sequence) {
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        Invocation &invocation = this->invocations[slot];
+
+        /* it finished just now, or the slot runs something else already */
+        if (invocation.entry == nullptr || invocation.sequence != sequence) {
+            pthread_mutex_unlock(&this->dispatchLock);
+            return;
+        }
+
+        invocation.overran = true;
+
+        const uint64_t elapsed = (monotonicNow() - invocation.started) / 1000000ull;
+        const ACPIOverrun overrun = noteOverrun(invocation.entry, invocation.event, elapsed, true);
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        reportOverrun(overrun);
+    }
+
+    /*
+     * Run the inline handlers collected by dispatch. Each one holds an
+     * invocation, so it can't be freed under us even though the table
+     * may be gone already.
+     */
+    void PowerManagement::ACPI::runInline(vector<HandlerEntry*> &batch, ACPIEvent event,
+                                          const EventTimes &times) {
+
+        for (HandlerEntry *entry : batch) {
+
+            count(this->counters->invocations[event]);
+
+            const uint64_t start = monotonicNow();
+
+            currentEntry = entry;
+            invokeHandler(*entry->callback, entry->id, event, 1, this->counters->failures[event]);
+            currentEntry = nullptr;
+
+            const uint64_t finish = monotonicNow();
+            const uint64_t elapsed = (finish - start) / 1000;
+
+            bool overran = false;
+            ACPIOverrun overrun;
+
+            if (times.received != 0) {
+                recordLatency(event, LATENCY_QUEUE, times.enqueued, start);
+                recordLatency(event, LATENCY_DELIVERY, times.received, start);
+                recordLatency(event, LATENCY_HANDLER, start, finish);
+            }
+
+            pthread_mutex_lock(&this->dispatchLock);
+
+            /* it already returned, so there is nothing to quarantine */
+            if (entry->budget != 0 && !entry->released) {
+                if (elapsed > entry->budget * 1000ull) {
+                    overrun = noteOverrun(entry, event, elapsed / 1000, false);
+                    overran = true;
+                } else {
+                    entry->overruns = 0;
+                }
+            }
+
+            if (elapsed > this->inlineBudget && !entry->released && entry->mode == DISPATCH_INLINE) {
+
+                fprintf(stderr, "inline ACPI handler took %lu us, over its budget of %u us\n",
+                        (unsigned long) elapsed, this->inlineBudget);
+
+                if (this->inlinePolicy == INLINE_DEMOTE) {
+                    fprintf(stderr, "moving the handler to the ACPI workers\n");
+                    entry->mode = DISPATCH_SERIAL;
+                }
+            }
+
+            const bool released = entry->released;
+            entry->inflight--;
+            pthread_cond_broadcast(&this->invocationDone);
+
+            ACPIPreSleepReport report;
+            const bool slept = preSleepHandled(entry, event, report);
+
+            if (released && entry->inflight == 0) {
+                delete entry;
+            }
+
+            pthread_mutex_unlock(&this->dispatchLock);
+
+            if (overran) {
+                reportOverrun(overrun);
+            }
+
+            if (slept) {
+                reportPreSleep(report);
+            }
+        }
+
+        batch.clear();
+    }
+
+    /* PrepareForSleep(true) came in, on the event thread */
+    void PowerManagement::ACPI::beginPreSleep(uint64_t now) {
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        this->preSleepActive = true;
+        this->preSleepDispatched = false;
+        this->preSleepPending = 0;
+        this->preSleepStarted = now;
+        this->preSleepTimes.clear();
+        this->preSleepSource = this->source;
+
+        const uint64_t generation = ++this->preSleepGeneration;
+        const unsigned int deadline = this->preSleepDeadline;
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        scheduleTimer(deadline, [this, generation]() { preSleepExpired(generation); });
+
+    }
+
+    /*
+     * POWER_S3S4_ENTER was given to a handler during a round. Must be
+     * called with the dispatch lock held.
+     */
+    void PowerManagement::ACPI::preSleepQueued(HandlerEntry *entry) {
+
+        ACPIPreSleepTime time = { entry->id, entry->handler, 0, false, false };
+
+        this->preSleepTimes.push_back(time);
+        this->preSleepPending++;
+
+    }
+
+    /*
+     * A handler returned from an event. Must be called with the dispatch
+     * lock held, true if that ended the round.
+     */
+    bool PowerManagement::ACPI::preSleepHandled(HandlerEntry *entry, ACPIEvent event, ACPIPreSleepReport &report) {
+
+        if (event != ACPIEvent::POWER_S3S4_ENTER || !this->preSleepActive) {
+            return false;
+        }
+
+        for (ACPIPreSleepTime &time : this->preSleepTimes) {
+
+            if (time.id != entry->id || time.finished || time.dropped) continue;
+
+            time.elapsed = (monotonicNow() - this->preSleepStarted) / 1000;
+            time.finished = true;
+
+            this->preSleepPending--;
+
+            return this->preSleepDispatched && this->preSleepPending == 0 && finishPreSleep(false, report);
+        }
+
+        /* one queued before the round */
+        return false;
+
+    }
+
+    /*
+     * Events from first on in the queue of an entry are about to be
+     * dropped, the handler will not wait on the round for those that are
+     * POWER_S3S4_ENTER. Must be called with the dispatch lock held, true
+     * if that ended the round.
+     */
+    bool PowerManagement::ACPI::preSleepDropped(HandlerEntry *entry, unsigned int first, unsigned int count,
+                                                ACPIPreSleepReport &report) {
+
+        if (!this->preSleepActive) {
+            return false;
+        }
+
+        unsigned int entering = 0;
+
+        for (unsigned int i = 0; i < count; i++) {
+            if (entry->queue[(first + i) % ACPI_HANDLER_QUEUE].event == ACPIEvent::POWER_S3S4_ENTER) {
+                entering++;
+            }
+        }
+
+        for (ACPIPreSleepTime &time : this->preSleepTimes) {
+
+            if (entering == 0) break;
+
+            if (time.id != entry->id || time.finished || time.dropped) continue;
+
+            time.elapsed = (monotonicNow() - this->preSleepStarted) / 1000;
+            time.dropped = true;
+
+            this->preSleepPending--;
+            entering--;
+        }
+
+        return this->preSleepDispatched && this->preSleepPending == 0 && finishPreSleep(false, report);
+
+    }
+
+    /*
+     * End the round and let the source know. Must be called with the
+     * dispatch lock held, false if no round was running.
+     */
+    bool PowerManagement::ACPI::finishPreSleep(bool timedOut, ACPIPreSleepReport &report) {
+
+        if (!this->preSleepActive) {
+            return false;
+        }
+
+        this->preSleepActive = false;
+
+        report.elapsed = (monotonicNow() - this->preSleepStarted) / 1000;
+        report.timedOut = timedOut;
+
+        for (ACPIPreSleepTime &time : this->preSleepTimes) {
+            if (!time.finished && !time.dropped) time.elapsed = report.elapsed;
+        }
+
+        report.handlers.swap(this->preSleepTimes);
+
+        if (this->preSleepSource != nullptr) {
+            this->preSleepSource->preSleepDone(this);
+            this->preSleepSource = nullptr;
+        }
+
+        return true;
+
+    }
+
+    /* the deadline of a round passed, on the event thread */
+    void PowerManagement::ACPI::preSleepExpired(uint64_t generation) {
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        ACPIPreSleepReport report;
+        const bool finished = generation == this->preSleepGeneration && finishPreSleep(true, report);
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (finished) {
+            reportPreSleep(report);
+        }
+
+    }
+
+    void PowerManagement::ACPI::reportPreSleep(const ACPIPreSleepReport &report) {
+
+        if (report.timedOut) {
+
+            size_t running = 0;
+
+            for (const ACPIPreSleepTime &time : report.handlers) {
+                if (!time.finished && !time.dropped) running++;
+            }
+
+            fprintf(stderr, "%zu pre-sleep ACPI handlers were still running after %llu ms\n",
+                    running, report.elapsed / 1000);
+        }
+
+        pthread_mutex_lock(&this->dispatchLock);
+        ACPIPreSleepCallback callback = this->preSleepCallback;
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (callback) {
+            callback(report);
+        }
+
+    }
+
+    void PowerManagement::ACPI::dispatch(ACPIEvent event, const EventTimes &times) {
+
+        /* reused by every dispatch on this thread, not reentered */
+        static thread_local vector<HandlerEntry*> inlineBatch;
+
+        if (times.received != 0) {
+            recordLatency(event, LATENCY_FILTER, times.classified, times.enqueued);
+        }
+
+        if (this->polling && !this->ring->push(event)) {
+            count(this->counters->pollOverflowed);
+        }
+
+        const unsigned int half = this->epoch.load() & 1;
+        this->dispatching[half]++;
+
+        HandlerTable *table = this->ACPIhandlers.load();
+
+        /* a round of pre-sleep handlers may be waiting for this one */
+        const bool preSleep = event == ACPIEvent::POWER_S3S4_ENTER;
+
+        /* dropping a queued POWER_S3S4_ENTER may end the round */
+        ACPIPreSleepReport report;
+        bool slept = false;
+
+        if (!table->subscribers[event].empty() || preSleep) {
+
+            pthread_mutex_lock(&this->dispatchLock);
+
+            const bool holding = preSleep && this->preSleepActive;
+
+            for (HandlerEntry *entry : table->subscribers[event]) {
+
+                if (entry->quarantined) {
+                    count(this->counters->quarantined);
+                    continue;
+                }
+
+                /* without workers everything runs inline */
+                if (entry->mode == DISPATCH_INLINE || this->polling) {
+                    entry->inflight++;
+                    inlineBatch.push_back(entry);
+                    if (holding) preSleepQueued(entry);
+                    continue;
+                }
+
+                if (this->overflowPolicy == OVERFLOW_COALESCE && entry->queueLength > 0) {
+
+                    unsigned int last = (entry->queueHead + entry->queueLength - 1) % ACPI_HANDLER_QUEUE;
+
+                    if (entry->queue[last].event == event) {
+                        entry->queue[last].repeat++;
+                        this->queueCounters.coalesced++;
+                        continue;
+                    }
+                }
+
+                if (entry->queueLength == ACPI_HANDLER_QUEUE) {
+
+                    this->queueCounters.overflowed++;
+
+#ifdef DEBUG
+                    printf("handler queue full, dropping event...\n");
+#endif
+
+                    if (this->overflowPolicy == OVERFLOW_DROP_NEWEST)
+                        continue;
+
+                    slept |= preSleepDropped(entry, entry->queueHead, 1, report);
+
+                    entry->queueHead = (entry->queueHead + 1) % ACPI_HANDLER_QUEUE;
+                    entry->queueLength--;
+                    entry->inflight--;
+                }
+
+                unsigned int tail = (entry->queueHead + entry->queueLength) % ACPI_HANDLER_QUEUE;
+                entry->queue[tail].event = event;
+                entry->queue[tail].repeat = 1;
+                entry->queue[tail].received = times.received;
+                entry->queue[tail].enqueued = times.enqueued;
+                entry->queueLength++;
+                entry->inflight++;
+
+                this->queueCounters.queued++;
+
+                if (holding) {
+                    preSleepQueued(entry);
+                }
+
+                /* a running serial handler is made ready when it is done */
+                if (!entry->ready && !entry->running) {
+                    makeReady(entry);
+                }
+            }
+
+            if (holding) {
+                this->preSleepDispatched = true;
+            }
+
+            pthread_cond_broadcast(&this->workAvailable);
+            pthread_mutex_unlock(&this->dispatchLock);
+        }
+
+        if (slept) {
+            reportPreSleep(report);
+        }
+
+        /*
+         * Done with the table before running anything inline, the inline
+         * handlers may add or remove handlers and wait for dispatchers
+         */
+        this->dispatching[half]--;
+
+        if (!inlineBatch.empty()) {
+            runInline(inlineBatch, event, times);
+        }
+
+    }
+
+    /*
+     * Put an entry at the end of the ready list. Must be called with
+     * the dispatch lock held.
+     */
+    void PowerManagement::ACPI::makeReady(HandlerEntry *entry) {
+
+        entry->ready = true;
+        entry->nextReady = nullptr;
+
+        if (this->readyTail != nullptr) {
+            this->readyTail->nextReady = entry;
+        } else {
+            this->readyHead = entry;
+        }
+
+        this->readyTail = entry;
+    }
+
+    /*
+     * Swap in a new handler table and return the old one, to be freed
+     * after synchronize(). Must be called with the registry lock held.
+     */
+    PowerManagement::ACPI::HandlerTable *PowerManagement::ACPI::publish(HandlerTable *table) {
+        return this->ACPIhandlers.exchange(table);
+    }
+
+    /*
+     * Wait until no dispatcher can be walking a table published over
+     * before this was called. Must not be called with the registry lock
+     * held, or from a dispatcher.
+     */
+    void PowerManagement::ACPI::synchronize() {
+
+        pthread_mutex_lock(&this->graceLock);
+
+        /*
+         * A dispatcher announces itself in its half of the epoch before
+         * loading the table. Those that start after the flip count in the
+         * other half and load the new table, the ones of this half are
+         * the only ones that might still hold an old table. A grace period
+         * before this one already waited for the half before that.
+         */
+        const unsigned int previous = this->epoch.fetch_add(1) & 1;
+
+        while (this->dispatching[previous].load() != 0) {
+            sched_yield();
+        }
+
+        pthread_mutex_unlock(&this->graceLock);
+    }
+
+    /*
+     * Drop the queued events of a removed entry, wait until it has no
+     * invocations running and free it. When called from inside the
+     * handler itself, only the other invocations are waited for and the
+     * calling one frees the entry when it returns.
+     */
+    void PowerManagement::ACPI::releaseEntry(HandlerEntry *entry) {
+
+        const bool self = currentEntry == entry;
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        ACPIPreSleepReport report;
+        const bool slept = preSleepDropped(entry, entry->queueHead, entry->queueLength, report);
+
+        entry->inflight -= entry->queueLength;
+        entry->queueLength = 0;
+
+        if (entry->ready) {
+
+            HandlerEntry **link = &this->readyHead;
+            HandlerEntry *previous = nullptr;
+
+            while (*link != entry) {
+                previous = *link;
+                link = &(*link)->nextReady;
+            }
+
+            *link = entry->nextReady;
+
+            if (this->readyTail == entry) {
+                this->readyTail = previous;
+            }
+
+            entry->ready = false;
+        }
+
+        if (slept) {
+            pthread_mutex_unlock(&this->dispatchLock);
+            reportPreSleep(report);
+            pthread_mutex_lock(&this->dispatchLock);
+        }
+
+        while (entry->inflight > (self ? 1 : 0)) {
+            pthread_cond_wait(&this->invocationDone, &this->dispatchLock);
+        }
+
+        if (self) {
+            entry->released = true;
+        }
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        if (!self) {
+            delete entry;
+        }
+    }
+
+    void PowerManagement::ACPI::startWorkers() {
+
+        pthread_mutex_lock(&this->dispatchLock);
+
+        if (this->workersRunning) {
+            pthread_mutex_unlock(&this->dispatchLock);
+            return;
+        }
+
+        this->workersRunning = true;
+
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        for (this->workerCount = 0; this->workerCount < ACPI_WORKERS; this->workerCount++) {
+            if (pthread_create(&this->workers[this->workerCount], NULL, worker, this) != 0) {
+                fprintf(stderr, "failed to start ACPI worker: %s\n", strerror(errno));
+                break;
+            }
+        }
+    }
+
+    void PowerManagement::ACPI::stopWorkers() {
+
+        pthread_mutex_lock(&this->dispatchLock);
+        this->workersRunning = false;
+        pthread_cond_broadcast(&this->workAvailable);
+        pthread_mutex_unlock(&this->dispatchLock);
+
+        for (size_t i = 0; i < this->workerCount; i++) {
+            pthread_join(this->workers[i], NULL);
+        }
+
+        this->workerCount = 0;
+        this->workerSlots = 0;
+    }
+
+    /*
+     * The latency histograms, one per event and stage. Recording is a
+     * few relaxed atomic additions on counters no lock protects, the
+     * reader sums up whatever is there at the moment.
+     */
+    struct PowerManagement::ACPI::LatencyHistogram {
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[ACPI_LATENCY_BUCKETS];
+
+        void record(uint64_t latency) {
+
+            /* the count is the sum of the buckets */
+            this->buckets[ACPILatency::bucketOf(latency)].fetch_add(1, std::memory_order_relaxed);
+            this->sum.fetch_add(latency, std::memory_order_relaxed);
+
+            uint64_t max = this->max.load(std::memory_order_relaxed);
+
+            while (latency > max && !this->max.compare_exchange_weak(max, latency, std::memory_order_relaxed));
+        }
+    };
+
+    size_t PowerManagement::ACPILatency::bucketOf(unsigned long long latency) {
+
+        if (latency < 8) return (size_t) latency;
+
+        const unsigned int exponent = 63 - __builtin_clzll(latency);
+
+        if (exponent > 40) return ACPI_LATENCY_BUCKETS - 1;
+
+        /* the top four bits, 8 to 15, pick the bucket within the power of two */
+        return (exponent - 3) * 8 + (size_t) (latency >> (exponent - 3));
+    }
+
+    unsigned long long PowerManagement::ACPILatency::bucketFloor(size_t bucket) {
+
+        if (bucket < 8) return bucket;
+
+        const unsigned int exponent = (unsigned int) (bucket / 8) + 2;
+
+        return (unsigned long long) (8 + bucket % 8) << (exponent - 3);
+    }
+
+    unsigned long long PowerManagement::ACPILatency::percentile(double percentile) const {
+
+        if (this->count == 0) return 0;
+
+        unsigned long long rank = (unsigned long long) ceil(this->count * percentile / 100.0);
+        unsigned long long seen = 0;
+
+        if (rank == 0) rank = 1;
+
+        for (size_t bucket = 0; bucket < ACPI_LATENCY_BUCKETS - 1; bucket++) {
+
+            seen += this->buckets[bucket];
+
+            if (seen >= rank) {
+                return std::min(bucketFloor(bucket + 1) - 1, this->max);
+            }
+        }
+
+        return this->max;
+    }
+
+    PowerManagement::ACPI::EventTimes PowerManagement::ACPI::receivedNow() {
+
+        EventTimes times = { 0, 0, 0 };
+
+        if (this->statsEnabled.load(std::memory_order_relaxed)) {
+            times.received = monotonicNow();
+        }
+
+        return times;
+    }
+
+    void PowerManagement::ACPI::classifiedNow(EventTimes &times) {
+        if (times.received != 0) {
+            times.classified = monotonicNow();
+        }
+    }
+
+    void PowerManagement::ACPI::recordLatency(ACPIEvent event, ACPILatencyStage stage,
+                                              uint64_t from, uint64_t to) {
+
+        LatencyHistogram *latency = this->latency.load(std::memory_order_acquire);
+
+        if (latency == nullptr) return;
+
+        latency[event * ACPILatencyStageCount + stage].record(to > from ? to - from : 0);
+    }
+
+    /*
+     * The debounce and rate limit state of one event type. A burst is in
+     * progress while the timer is armed.
+     */
+    struct PowerManagement::ACPI::FilterState {
+
+        ACPIEventFilter filter;
+
+        /* false while the filter is all zero, read without the lock */
+        std::atomic<bool> active;
+
+        uint64_t lastReceived;
+        uint64_t lastDelivered;
+        bool delivered;
+
+        /* an event of the burst was held back for the trailing edge */
+        bool pending;
+        EventTimes pendingTimes;
+        bool armed;
+    };
+
+    void PowerManagement::ACPI::emit(ACPIEvent event, const EventTimes &times) {
+
+        count(this->counters->received[event]);
+
+        if (times.received != 0) {
+            recordLatency(event, LATENCY_CLASSIFY, times.received, times.classified);
+        }
+
+        FilterState &state = this->filters[event];
+
+        /* without a filter the event is queued right away, no need to read the clock again */
+        if (!state.active.load(std::memory_order_acquire)) {
+            EventTimes unfiltered = times;
+            unfiltered.enqueued = times.classified;
+            dispatch(event, unfiltered);
+            return;
+        }
+
+        const uint64_t now = monotonicNow();
+
+        /* inline handlers may set filters, so they are dispatched without the lock */
+        EventTimes filtered = times;
+
+        pthread_mutex_lock(&this->filterLock);
+
+        const ACPIEventFilter &filter = state.filter;
+
+        if (filter.interval == 0) {
+            const bool passed = deliver(state, event, now, filtered);
+            pthread_mutex_unlock(&this->filterLock);
+            if (passed) dispatch(event, filtered);
+            return;
+        }
+
+        state.lastReceived = now;
+
+        if (!state.armed) {
+
+            /* the first event of a burst */
+            state.armed = true;
+            scheduleTimer(filter.interval, [this, event]() { filterExpired(event); });
+
+            if (filter.leading || !filter.trailing) {
+                state.pending = false;
+                const bool passed = deliver(state, event, now, filtered);
+                pthread_mutex_unlock(&this->filterLock);
+                if (passed) dispatch(event, filtered);
+                return;
+            }
+        }
+
+#ifdef DEBUG
+        if (!filter.trailing) {
+            printf("debouncing event %d...\n", event);
+        }
+#endif
+
+        state.pending = filter.trailing;
+        state.pendingTimes = times;
+
+        pthread_mutex_unlock(&this->filterLock);
+
+    }
+
+    void PowerManagement::ACPI::filterExpired(ACPIEvent event) {
+
+        FilterState &state = this->filters[event];
+
+        const uint64_t now = monotonicNow();
+
+        pthread_mutex_lock(&this->filterLock);
+
+        /*
+         * Every event of a burst pushes its end further out, rather than
+         * rescheduling on each of them the timer checks when it fires
+         */
+        const uint64_t end = state.lastReceived + state.filter.interval * 1000000ull;
+
+        if (end > now) {
+            const unsigned int remaining = (unsigned int) ((end - now + 999999ull) / 1000000ull);
+            scheduleTimer(remaining, [this, event]() { filterExpired(event); });
+            pthread_mutex_unlock(&this->filterLock);
+            return;
+        }
+
+        state.armed = false;
+
+        EventTimes filtered = state.pendingTimes;
+        bool passed = false;
+
+        if (state.pending) {
+            state.pending = false;
+            passed = deliver(state, event, now, filtered);
+        }
+
+        pthread_mutex_unlock(&this->filterLock);
+
+        if (passed) dispatch(event, filtered);
+
+    }
+
+    /* with the filter lock held, the caller dispatches the event if it passed */
+    bool PowerManagement::ACPI::deliver(FilterState &state, ACPIEvent event, uint64_t now,
+                                        EventTimes &times) {
+
+        const unsigned int maxRate = state.filter.maxRate;
+
+        if (maxRate != 0 && state.delivered && now - state.lastDelivered < 1000000000ull / maxRate) {
+
+#ifdef DEBUG
+            printf("rate limiting event %d...\n", event);
+#endif
+
+            return false;
+        }
+
+        state.delivered = true;
+        state.lastDelivered = now;
+
+        times.enqueued = times.received != 0 ? monotonicNow() : 0;
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::dockSettled() {
+
+        /* changes from here on schedule another check */
+        this->dockSettling = false;
+
+        /* the cache read the dock when it was still settling */
+        if (this->hardwareCache) {
+            Hardware::HardwareCache::refresh(IBM_DOCK);
+        }
+
+        Hardware::Dock dock;
+
+        const ACPIEvent event = dock.isDocked() ? ACPIEvent::DOCKED : ACPIEvent::UNDOCKED;
+        recordState(event);
+
+        PROBE2(udev_classify, (int) event, IBM_DOCK);
+
+        emit(event, this->dockTimes);
+
+    }
+
+    PowerManagement::ACPI::ACPI() :
+        enteringS3S4(false),
+        recordFd(-1),
+        ACPIhandlers(new HandlerTable),
+        epoch(0),
+        dispatching(),
+        timers(new TimerWheel),
+        filters(new FilterState[ACPIEventCount]()),
+        dockSettling(false),
+        latency(nullptr),
+        statsEnabled(false),
+        counters(new Counters())
+    {
+        pthread_mutex_init(&this->listenLock, NULL);
+        pthread_cond_init(&this->listenDone, NULL);
+        pthread_mutex_init(&this->recordLock, NULL);
+        pthread_mutex_init(&this->metricsLock, NULL);
+        pthread_mutex_init(&this->statsLock, NULL);
+        pthread_mutex_init(&this->filterLock, NULL);
+        pthread_mutex_init(&this->registryLock, NULL);
+        pthread_mutex_init(&this->graceLock, NULL);
+        pthread_mutex_init(&this->dispatchLock, NULL);
+        pthread_cond_init(&this->workAvailable, NULL);
+
+        /* stop() waits on it with a deadline that must not follow the wall clock */
+        pthread_condattr_t monotonic;
+        pthread_condattr_init(&monotonic);
+        pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+        pthread_cond_init(&this->invocationDone, &monotonic);
+        pthread_condattr_destroy(&monotonic);
+    }
+
+    PowerManagement::ACPI::~ACPI()
+    {
+
+        /* no events or timers come in anymore */
+        stopListening();
+        stopRecording();
+
+        if (this->netlinkFd >= 0) {
+            close(this->netlinkFd);
+        }
+
+        for (int fd : this->inputFds) {
+            close(fd);
+        }
+
+        /* drop the queued events and wait for the running handlers */
+        pthread_mutex_lock(&this->registryLock);
+
+        HandlerTable *table = this->ACPIhandlers.exchange(nullptr);
+
+        pthread_mutex_unlock(&this->registryLock);
+
+        for (HandlerEntry *entry : table->entries) {
+            releaseEntry(entry);
+        }
+
+        delete table;
+
+        stopWorkers();
+
+        /* the handlers still running cancelled their watchdogs here */
+        delete this->timers;
+
+        pthread_cond_destroy(&this->invocationDone);
+        pthread_cond_destroy(&this->workAvailable);
+        pthread_mutex_destroy(&this->dispatchLock);
+        pthread_mutex_destroy(&this->graceLock);
+        pthread_mutex_destroy(&this->registryLock);
+        pthread_mutex_destroy(&this->filterLock);
+        pthread_mutex_destroy(&this->statsLock);
+        pthread_mutex_destroy(&this->metricsLock);
+        pthread_mutex_destroy(&this->recordLock);
+        pthread_cond_destroy(&this->listenDone);
+        pthread_mutex_destroy(&this->listenLock);
+
+        delete[] this->filters;
+        delete[] this->latency.load();
+        delete this->counters;
+        delete this->ring;
+
+    }
+
+    PowerManagement::ACPIHandlerId PowerManagement::ACPI::addEntry(ACPICallback *callback,
+                                                                   ACPIEventHandler *handler,
+                                                                   ACPIEventMask mask,
+                                                                   ACPIDispatchMode mode) {
+
+        HandlerEntry *entry = new HandlerEntry;
+
+        entry->callback = callback;
+        entry->handler = handler;
+        entry->mask = mask;
+        entry->mode = mode;
+        entry->queueHead = 0;
+        entry->queueLength = 0;
+        entry->ready = false;
+        entry->nextReady = nullptr;
+        entry->running = false;
+        entry->inflight = 0;
+        entry->released = false;
+        entry->budget = 0;
+        entry->overruns = 0;
+        entry->quarantined = false;
+
+        pthread_mutex_lock(&this->registryLock);
+
+        /* the entry may already be removed again once we unlock */
+        const ACPIHandlerId id = entry->id = ++this->lastHandlerId;
+
+        HandlerTable *table = new HandlerTable(*this->ACPIhandlers.load());
+        table->add(entry);
+        HandlerTable *old = publish(table);
+
+        pthread_mutex_unlock(&this->registryLock);
+
+        synchronize();
+        delete old;
+
+        return id;
+
+    }
+
+    bool PowerManagement::ACPI::removeEntries(ACPIEventHandler *handler, ACPIHandlerId id) {
+
+        pthread_mutex_lock(&this->registryLock);
+
+        HandlerTable *current = this->ACPIhandlers.load();
+        HandlerTable *table = new HandlerTable;
+        vector<HandlerEntry*> removed;
+
+        for (HandlerEntry *entry : current->entries) {
+            if ((handler != nullptr && entry->handler == handler) || (id != 0 && entry->id == id)) {
+                removed.push_back(entry);
+            } else {
+                table->add(entry);
+            }
+        }
+
+        if (removed.empty()) {
+            pthread_mutex_unlock(&this->registryLock);
+            delete table;
+            return false;
+        }
+
+        HandlerTable *old = publish(table);
+
+        pthread_mutex_unlock(&this->registryLock);
+
+        /* after this, no dispatcher can queue a new event for them */
+        synchronize();
+        delete old;
+
+        /*
+         * Not under the registry lock, the handlers we are waiting for
+         * may be adding or removing handlers themselves
+         */
+        for (HandlerEntry *entry : removed) {
+            releaseEntry(entry);
+        }
+
+        return true;
+
+    }
+
+    void PowerManagement::ACPI::addEventHandler(PowerManagement::ACPIEventHandler *handler,
+                                                ACPIEventMask mask,
+                                                ACPIDispatchMode mode) {
+        VirtualHandler function = { handler };
+        addEntry(new ACPICallback(function), handler, mask, mode);
+    }
+
+    bool PowerManagement::ACPI::removeEventHandler(PowerManagement::ACPIEventHandler *handler) {
+        return removeEntries(handler, 0);
+    }
+
+    bool PowerManagement::ACPI::removeEventHandler(ACPIHandlerId id) {
+        return removeEntries(nullptr, id);
+    }
+
+    void PowerManagement::ACPI::setOverflowPolicy(ACPIOverflowPolicy policy) {
+        pthread_mutex_lock(&this->dispatchLock);
+        this->overflowPolicy = policy;
+        pthread_mutex_unlock(&this->dispatchLock);
+    }
+
+    void PowerManagement::ACPI::setInlineBudget(unsigned int budget, ACPIInlinePolicy policy) {
+        pthread_mutex_lock(&this->dispatchLock);
+        this->inlineBudget = budget;
+        this->inlinePolicy = policy;
+        pthread_mutex_unlock(&this->dispatchLock);
+    }
+
+    PowerManagement::ACPIQueueCounters PowerManagement::ACPI::getQueueCounters() {
+        pthread_mutex_lock(&this->dispatchLock);
+        ACPIQueueCounters counters = this->queueCounters;
+        pthread_mutex_unlock(&this->dispatchLock);
+        return counters;
+    }
+
+    void PowerManagement::ACPI::setEventFilter(ACPIEvent event, ACPIEventFilter filter) {
+
+        FilterState &state = this->filters[event];
+
+        pthread_mutex_lock(&this->filterLock);
+
+        state.filter = filter;
+        state.active.store(filter.interval != 0 || filter.maxRate != 0, std::memory_order_release);
+
+        pthread_mutex_unlock(&this->filterLock);
+    }
+
+    bool PowerManagement::ACPI::setBudget(ACPIEventHandler *handler, ACPIHandlerId id, unsigned int budget) {
+
+        bool found = false;
+
+        /* the entries can't be freed while we hold the registry lock */
+        pthread_mutex_lock(&this->registryLock);
+        pthread_mutex_lock(&this->dispatchLock);
+
+        for (HandlerEntry *entry : this->ACPIhandlers.load()->entries) {
+            if ((handler != nullptr && entry->handler == handler) || (id != 0 && entry->id == id)) {
+                entry->budget = budget;
+                entry->overruns = 0;
+                found = true;
+            }
+        }
+
+        pthread_mutex_unlock(&this->dispatchLock);
+        pthread_mutex_unlock(&this->registryLock);
+
+        return found;
+    }
+
+    bool PowerManagement::ACPI::setHandlerBudget(ACPIEventHandler *handler, unsigned int budget) {
+        return setBudget(handler, 0, budget);
+    }
+
+    bool PowerManagement::ACPI::setHandlerBudget(ACPIHandlerId id, unsigned int budget) {
+        return setBudget(nullptr, id, budget);
+    }
+
+    void PowerManagement::ACPI::setWatchdog(ACPIOverrunCallback callback, unsigned int quarantineAfter) {
+        pthread_mutex_lock(&this->dispatchLock);
+        this->overrunCallback = std::move(callback);
+        this->quarantineAfter = quarantineAfter;
+        pthread_mutex_unlock(&this->dispatchLock);
+    }
+
+    void PowerManagement::ACPI::enableStats(bool enabled) {
+
+        pthread_mutex_lock(&this->statsLock);
+
+        if (enabled && this->latency.load() == nullptr) {
+            this->latency.store(new LatencyHistogram[ACPIEventCount * ACPILatencyStageCount](),
+                                std::memory_order_release);
+        }
+
+        this->statsEnabled = enabled;
+
+        pthread_mutex_unlock(&this->statsLock);
+    }
+
+    PowerManagement::ACPIStats PowerManagement::ACPI::stats() {
+
+        ACPIStats stats;
+        stats.latency.resize(ACPIEventCount * ACPILatencyStageCount);
+
+        LatencyHistogram *latency = this->latency.load(std::memory_order_acquire);
+
+        for (size_t i = 0; latency != nullptr && i < ACPIEventCount * ACPILatencyStageCount; i++) {
+
+            ACPILatency &snapshot = stats.latency[i];
+
+            snapshot.sum = latency[i].sum.load(std::memory_order_relaxed);
+            snapshot.max = latency[i].max.load(std::memory_order_relaxed);
+            snapshot.count = 0;
+
+            for (size_t bucket = 0; bucket < ACPI_LATENCY_BUCKETS; bucket++) {
+                snapshot.buckets[bucket] = latency[i].buckets[bucket].load(std::memory_order_relaxed);
+                snapshot.count += snapshot.buckets[bucket];
+            }
+        }
+
+        return stats;
+    }
+
+    PowerManagement::ACPIMetrics PowerManagement::ACPI::metrics() {
+
+        ACPIMetrics metrics;
+
+        for (size_t event = 0; event < ACPIEventCount; event++) {
+            metrics.received[event] = this->counters->received[event].load(std::memory_order_relaxed);
+            metrics.invocations[event] = this->counters->invocations[event].load(std::memory_order_relaxed);
+            metrics.failures[event] = this->counters->failures[event].load(std::memory_order_relaxed);
+            metrics.overruns[event] = this->counters->overruns[event].load(std::memory_order_relaxed);
+        }
+
+        metrics.unknownLines = this->counters->unknownLines.load(std::memory_order_relaxed);
+        metrics.purgedLines = this->counters->purgedLines.load(std::memory_order_relaxed);
+        metrics.udevIgnored = this->counters->udevIgnored.load(std::memory_order_relaxed);
+        metrics.udevOverflows = this->counters->udevOverflows.load(std::memory_order_relaxed);
+        metrics.reconnects = this->counters->reconnects.load(std::memory_order_relaxed);
+        metrics.quarantined = this->counters->quarantined.load(std::memory_order_relaxed);
+        metrics.pollOverflowed = this->counters->pollOverflowed.load(std::memory_order_relaxed);
+
+        return metrics;
+    }
+
+    static void writeCounter(FILE *file, const char *name, const char *help, unsigned long long value) {
+        fprintf(file, "# HELP libthinkpad_%s_total %s\n", name, help);
+        fprintf(file, "# TYPE libthinkpad_%s_total counter\n", name);
+        fprintf(file, "libthinkpad_%s_total %llu\n", name, value);
+    }
+
+    static void writeEventCounter(FILE *file, const char *name, const char *help,
+                                  const unsigned long long (&values)[PowerManagement::ACPIEventCount]) {
+
+        fprintf(file, "# HELP libthinkpad_%s_total %s\n", name, help);
+        fprintf(file, "# TYPE libthinkpad_%s_total counter\n", name);
+
+        for (size_t event = 0; event < PowerManagement::ACPIEventCount; event++) {
+            fprintf(file, "libthinkpad_%s_total{event=\"%s\"} %llu\n", name, acpiEventNames[event], values[event]);
+        }
+    }
+
+    bool PowerManagement::ACPI::writeMetrics(const string &path) {
+
+        const ACPIMetrics metrics = this->metrics();
+        const ACPIQueueCounters queue = getQueueCounters();
+
+        const string temporary = path + ".tmp";
+
+        FILE *file = fopen(temporary.c_str(), "w");
+
+        if (file == NULL) {
+            fprintf(stderr, "failed to write the metrics to %s: %s\n", temporary.c_str(), strerror(errno));
+            return false;
+        }
+
+        writeEventCounter(file, "events_received", "ACPI events received", metrics.received);
+        writeEventCounter(file, "handler_invocations", "ACPI handler invocations", metrics.invocations);
+        writeEventCounter(file, "handler_failures", "ACPI handler invocations that threw", metrics.failures);
+        writeEventCounter(file, "handler_overruns", "ACPI handler invocations over their budget", metrics.overruns);
+        writeCounter(file, "handler_quarantined", "Events not given to quarantined handlers", metrics.quarantined);
+        writeCounter(file, "poll_overflowed", "Events dropped from the full ring of a polled instance", metrics.pollOverflowed);
+        writeCounter(file, "acpid_unknown_lines", "acpid lines of unknown events", metrics.unknownLines);
+        writeCounter(file, "acpid_purged_lines", "acpid lines purged for being too long", metrics.purgedLines);
+        writeCounter(file, "acpid_reconnects", "acpid connections established again", metrics.reconnects);
+        writeCounter(file, "udev_ignored", "udev devices that did not lead to an event", metrics.udevIgnored);
+        writeCounter(file, "udev_overflows", "udev receive buffer overflows that dropped devices", metrics.udevOverflows);
+        writeCounter(file, "events_queued", "Events queued on handlers", queue.queued);
+        writeCounter(file, "events_overflowed", "Events dropped from full handler queues", queue.overflowed);
+        writeCounter(file, "events_coalesced", "Events merged into the previous identical event", queue.coalesced);
+        writeCounter(file, "events_cancelled", "Queued events dropped by stopping", queue.cancelled);
+
+        const bool written = fflush(file) == 0 && !ferror(file);
+
+        if (fclose(file) != 0 || !written || rename(temporary.c_str(), path.c_str()) != 0) {
+            fprintf(stderr, "failed to write the metrics to %s: %s\n", path.c_str(), strerror(errno));
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    void PowerManagement::ACPI::writeMetricsPeriodically(unsigned int generation) {
+
+        pthread_mutex_lock(&this->metricsLock);
+
+        /* the file or interval changed since this was scheduled */
+        if (generation != this->metricsGeneration) {
+            pthread_mutex_unlock(&this->metricsLock);
+            return;
+        }
+
+        const string path = this->metricsPath;
+        const unsigned int interval = this->metricsInterval;
+
+        this->metricsTimer = scheduleTimer(interval, [this, generation]() {
+            writeMetricsPeriodically(generation);
+        });
+
+        pthread_mutex_unlock(&this->metricsLock);
+
+        writeMetrics(path);
+    }
+
+    void PowerManagement::ACPI::setMetricsFile(const string &path, unsigned int interval) {
+
+        pthread_mutex_lock(&this->metricsLock);
+
+        const unsigned int generation = ++this->metricsGeneration;
+
+        if (this->metricsTimer != 0) {
+            cancelTimer(this->metricsTimer);
+            this->metricsTimer = 0;
+        }
+
+        this->metricsPath = path;
+        this->metricsInterval = interval;
+
+        if (interval != 0) {
+            this->metricsTimer = scheduleTimer(interval, [this, generation]() {
+                writeMetricsPeriodically(generation);
+            });
+        }
+
+        pthread_mutex_unlock(&this->metricsLock);
+    }
+
+    bool PowerManagement::ACPI::startRecording(const string &path) {
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            fprintf(stderr, "failed to record into %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        /* a new log starts with the magic */
+        struct stat status;
+
+        if (fstat(fd, &status) != 0 || (status.st_size == 0 && write(fd, RECORD_MAGIC, RECORD_MAGIC_SIZE) != RECORD_MAGIC_SIZE)) {
+            fprintf(stderr, "failed to record into %s: %s\n", path.c_str(), strerror(errno));
+            close(fd);
             return false;
         }
 
-        sd_bus_error_free(&error);
-        sd_bus_unref(bus);
+        pthread_mutex_lock(&this->recordLock);
+
+        const int previous = this->recordFd.exchange(fd);
+
+        if (previous >= 0) {
+            close(previous);
+        }
+
+        pthread_mutex_unlock(&this->recordLock);
 
         return true;
+    }
 
-#endif
+    void PowerManagement::ACPI::stopRecording() {
 
-        fprintf(stderr, "no suspend mechanism available\n");
-        return false;
+        pthread_mutex_lock(&this->recordLock);
+
+        const int fd = this->recordFd.exchange(-1);
+
+        if (fd >= 0) {
+            close(fd);
+        }
 
+        pthread_mutex_unlock(&this->recordLock);
     }
 
-    bool PowerManagement::PowerStateManager::requestSuspend(SuspendReason reason) {
+    /*
+     * Classify and emit one record of a log, false for the records that
+     * are not replayed. The lid and dock records were classified by
+     * reading the hardware, their state records are replayed instead.
+     */
+    bool PowerManagement::ACPI::replayRecord(uint8_t source, const char *payload, size_t length) {
 
-        Hardware::Dock dock;
+        EventTimes times = receivedNow();
 
-        switch (reason) {
-            case SuspendReason::BUTTON:
-                return PowerManagement::PowerStateManager::suspend();
-            case SuspendReason::LID:
-                if (!dock.probe()) {
-                    fprintf(stderr, "dock is not sane/present");
-                    return false;
-                }
+        if (source == RECORD_ACPID) {
+            handleAcpidLine(payload, length, times);
+        } else if (source == RECORD_UDEV && length >= sizeof(uint64_t)) {
 
-                if(!dock.isDocked()) {
-                    PowerManagement::PowerStateManager::suspend();
-                    return true;
-                }
+            /* the seqnum only tells the records apart in the log */
+            const char *action = payload + sizeof(uint64_t);
+            const char *syspath = action + strlen(action) + 1;
 
-                fprintf(stderr, "ignoring lid event when docked\n");
-                return false;
-            default:
-                fprintf(stderr, "invalid suspend reason \n");
-                return false;
+            if (syspath >= payload + length) syspath = "";
+
+            if (strstr(syspath, IBM_DOCK) != NULL) return false;
+
+            handleUdevDevice(action, syspath, times);
+        } else if (source == RECORD_NETLINK && length == sizeof(KernelEvent)) {
+
+            KernelEvent event;
+            memcpy(&event, payload, sizeof(KernelEvent));
+
+            event.deviceClass[sizeof(event.deviceClass) - 1] = '\0';
+            event.busId[sizeof(event.busId) - 1] = '\0';
+
+            if (strcmp(event.deviceClass, "button/lid") == 0) return false;
+
+            handleKernelEvent(event, times);
+        } else if (source == RECORD_INPUT && length == sizeof(uint16_t)) {
+
+            uint16_t code;
+            memcpy(&code, payload, sizeof(uint16_t));
+
+            handleInputKey(code, times);
+        } else if (source == RECORD_LOGIND && length == sizeof(uint8_t)) {
+            handleSleepSignal(payload[0] != 0, times);
+        } else if (source == RECORD_STATE && length == sizeof(uint8_t) && (uint8_t) payload[0] < ACPIEventCount) {
+            classifiedNow(times);
+            emit((ACPIEvent) payload[0], times);
+        } else {
+            return false;
         }
 
+        return true;
     }
 
-    /******************** ACPI ********************/
+    /*
+     * Run a callable on the event thread, where the events that come in
+     * are handled, and wait for it. False if the instance stopped
+     * listening before it ran.
+     */
+    bool PowerManagement::ACPI::runOnEventThread(ACPITimerCallback &function) {
 
-    pthread_t PowerManagement::ACPI::acpid_listener = -1;
-    pthread_t PowerManagement::ACPI::udev_listener = -1;
+        bool ran = false;
 
-    void *PowerManagement::ACPI::handle_acpid(void *_this) {
+        const ACPITimerId timer = scheduleTimer(0, [this, &function, &ran]() {
 
-        ACPI *acpiClass = (ACPI*) _this;
+            function();
 
-        struct sockaddr_un addr;
+            pthread_mutex_lock(&this->listenLock);
+            ran = true;
+            pthread_cond_broadcast(&this->listenDone);
+            pthread_mutex_unlock(&this->listenLock);
+        });
 
-        memset(&addr, 0, sizeof(struct sockaddr_un));
+        pthread_mutex_lock(&this->listenLock);
 
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, ACPID_SOCK, strlen(ACPID_SOCK));
+        while (!ran && this->listening) {
+            pthread_cond_wait(&this->listenDone, &this->listenLock);
+        }
 
-        int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        pthread_mutex_unlock(&this->listenLock);
 
-        if (connect(sfd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0) {
-            printf("Connect failed: %s\n", strerror(errno));
-            return NULL;
+        if (ran || cancelTimer(timer)) {
+            return ran;
         }
 
-#ifdef DEBUG
+        /* it was already taken off the wheel, stopping waits for the timers that run */
+        pthread_mutex_lock(&this->listenLock);
 
-        printf("starting acpid listener...\n");
+        while (!ran) {
+            pthread_cond_wait(&this->listenDone, &this->listenLock);
+        }
 
-#endif
+        pthread_mutex_unlock(&this->listenLock);
 
-        char buf[BUFSIZE];
-        char inbuf[INBUFSZ];
+        return true;
+    }
 
-        memset(buf, 0, BUFSIZE);
-        memset(inbuf, 0, INBUFSZ);
+    long PowerManagement::ACPI::replay(const string &path, double speed) {
 
-        int bufptr = 0;
+        /* the ring of a polled instance only takes events from the thread driving it */
+        if (this->polling) {
+            fprintf(stderr, "failed to replay %s: the instance is polled\n", path.c_str());
+            return -1;
+        }
 
-        while (read(sfd, inbuf, INBUFSZ) > 0) {
+        FILE *file = fopen(path.c_str(), "r");
 
-            buf[bufptr] = inbuf[0];
-            bufptr++;
+        if (file == NULL) {
+            fprintf(stderr, "failed to replay %s: %s\n", path.c_str(), strerror(errno));
+            return -1;
+        }
 
-            if (bufptr > BUFSIZE) {
-                printf("Buffer full, purging event...\n");
-                bufptr = 0;
-                memset(buf, 0, BUFSIZE);
-            }
+        char magic[RECORD_MAGIC_SIZE];
 
-            if (inbuf[0] == 0x0A) {
+        if (fread(magic, RECORD_MAGIC_SIZE, 1, file) != 1 || memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+            fprintf(stderr, "failed to replay %s: not an event log\n", path.c_str());
+            fclose(file);
+            return -1;
+        }
 
-                ACPIEvent event = ACPIEvent::UNKNOWN;
+        /* the longest payload and a NUL byte */
+        std::unique_ptr<char[]> payload(new char[UINT16_MAX + 1]);
+
+        /* where the replay is, the event thread picks it up from there */
+        struct {
+            FILE *file;
+            char *payload;
+            RecordHeader header;
+            bool pending;
+            bool ended;
+            uint64_t recorded;
+            uint64_t started;
+            uint64_t due;
+            long replayed;
+        } state = {};
+
+        state.file = file;
+        state.payload = payload.get();
+
+        /*
+         * Replays the records that are due, a batch at most so the events
+         * that come in meanwhile are not held up for long. Sets due to when
+         * the next one is, 0 if it is due already.
+         */
+        ACPITimerCallback replayDue([this, &state, &path, speed]() {
 
-                if (strstr(buf, ACPI_POWERBUTTON) != NULL) {
-                    event = ACPIEvent::BUTTON_POWER;
-                }
+            RecordHeader &header = state.header;
 
-                if (strstr(buf, ACPI_LID_OPEN) != NULL) {
-                    event = ACPIEvent::LID_OPENED;
-                }
+            state.due = 0;
 
-                if (strstr(buf, ACPI_LID_CLOSE) != NULL) {
-                    event = ACPIEvent::LID_CLOSED;
-                }
+            for (unsigned int batch = 0; batch < ACPI_REPLAY_BATCH; batch++) {
 
-                if (strstr(buf, ACPI_BUTTON_VOLUME_UP) != NULL) {
-                    event = ACPIEvent::BUTTON_VOLUME_UP;
-                }
+                if (!state.pending) {
 
-                if (strstr(buf, ACPI_BUTTON_VOLUME_DOWN) != NULL) {
-                    event = ACPIEvent::BUTTON_VOLUME_DOWN;
-                }
+                    if (fread(&header, sizeof(RecordHeader), 1, state.file) != 1) {
+                        state.ended = true;
+                        return;
+                    }
 
-                if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_DOWN) != NULL) {
-                    event = ACPIEvent::BUTTON_BRIGHTNESS_DOWN;
-                }
+                    if (fread(state.payload, 1, header.length, state.file) != header.length) {
+                        fprintf(stderr, "%s ends in a torn record, replayed %ld events\n", path.c_str(), state.replayed);
+                        state.ended = true;
+                        return;
+                    }
 
-                if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_UP) != NULL) {
-                    event = ACPIEvent::BUTTON_BRIGHTNESS_UP;
-                }
+                    state.payload[header.length] = '\0';
 
-                if (strstr(buf, ACPI_BUTTON_MICMUTE) != NULL) {
-                    event = ACPIEvent::BUTTON_MICMUTE;
-                }
+                    if (state.started == 0) {
+                        state.recorded = header.time;
+                        state.started = monotonicNow();
+                    }
 
-                if (strstr(buf, ACPI_BUTTON_MUTE) != NULL) {
-                    event = ACPIEvent::BUTTON_MUTE;
+                    state.pending = true;
                 }
 
-                if (strstr(buf, ACPI_BUTTON_THINKVANTAGE) != NULL) {
-                    event = ACPIEvent::BUTTON_THINKVANTAGE;
-                }
+                /* keep the recorded pace, a clock jump backwards in the log does not pause */
+                if (speed > 0 && header.time > state.recorded) {
 
-                if (strstr(buf, ACPI_BUTTON_FNF2_LOCK) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF2_LOCK;
-                }
+                    const uint64_t due = state.started + (uint64_t) ((header.time - state.recorded) / speed);
 
-                if (strstr(buf, ACPI_BUTTON_FNF3_BATTERY) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF3_BATTERY;
+                    if (due > monotonicNow()) {
+                        state.due = due;
+                        return;
+                    }
                 }
 
-                if (strstr(buf, ACPI_BUTTON_FNF5_WLAN) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF5_WLAN;
-                }
+                state.pending = false;
 
-                if (strstr(buf, ACPI_BUTTON_FNF4_SLEEP) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF4_SLEEP;
+                if (replayRecord(header.source, state.payload, header.length)) {
+                    state.replayed++;
                 }
+            }
+        });
 
-                if (strstr(buf, ACPI_BUTTON_FNF7_PROJECTOR) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF7_PROJECTOR;
-                }
+        while (!state.ended) {
 
-                if (strstr(buf, ACPI_BUTTON_FNF12_HIBERNATE) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF12_SUSPEND;
-                }
+            pthread_mutex_lock(&this->listenLock);
+            const bool listening = this->listening;
+            pthread_mutex_unlock(&this->listenLock);
 
-                if (strstr(buf, ACPI_DOCK_EVENT) != NULL ||
-				strstr(buf, ACPI_DOCK_EVENT2) != NULL) {
-                    event = ACPIEvent::DOCKED;
-                }
+            /* nothing else hands out events once the instance stopped listening */
+            if (!listening || !runOnEventThread(replayDue)) {
+                replayDue();
+            }
 
-                if (strstr(buf, ACPI_UNDOCK_EVENT) != NULL ||
-				strstr(buf, ACPI_UNDOCK_EVENT2) != NULL) {
-                    event = ACPIEvent::UNDOCKED;
-                }
+            if (state.due != 0) {
 
-                for (ACPIEventHandler* Acpihandler : *acpiClass->ACPIhandlers) {
+                struct timespec wakeup;
+                wakeup.tv_sec = (time_t) (state.due / 1000000000ull);
+                wakeup.tv_nsec = (long) (state.due % 1000000000ull);
 
-                    pthread_t handler;
-                    ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR);
+            }
+        }
 
-                    metadata->event = event;
-                    metadata->handler = Acpihandler;
+        fclose(file);
 
-                    pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata);
-                    pthread_detach(handler);
+        return state.replayed;
+    }
 
-                }
+    void PowerManagement::ACPI::setAcpidSocket(const string &path) {
+        this->acpidSocket = path;
+    }
 
-                bufptr = 0;
-                memset(buf, 0, BUFSIZE);
-            }
+    void PowerManagement::ACPI::setNetlinkSource(int fd) {
 
+        if (this->netlinkFd >= 0 && this->netlinkFd != fd) {
+            close(this->netlinkFd);
         }
 
-        close(sfd);
-        return nullptr;
+        this->netlinkSource = true;
+        this->netlinkFd = fd;
     }
 
-    void* PowerManagement::ACPI::handle_udev(void* _this){
+    void PowerManagement::ACPI::setLogindSource() {
+        this->logindSource = true;
+    }
 
-#ifdef DEBUG
+    void PowerManagement::ACPI::setHardwareCache() {
+        this->hardwareCache = true;
+    }
 
-        printf("starting udev listener...\n");
+    void PowerManagement::ACPI::setPreSleep(unsigned int deadline, ACPIPreSleepCallback report) {
 
-#endif
+        this->logindSource = true;
+
+        pthread_mutex_lock(&this->dispatchLock);
+        this->preSleepDeadline = deadline;
+        this->preSleepCallback = report;
+        pthread_mutex_unlock(&this->dispatchLock);
+    }
 
-        ACPI *acpiClass = (ACPI*) _this;
+    void PowerManagement::ACPI::setInputSource(int fd) {
 
-        struct udev* udev = udev_new();
-        struct udev_monitor *monitor = udev_monitor_new_from_netlink(udev, "udev");
+        this->inputSource = true;
 
-        udev_monitor_filter_add_match_subsystem_devtype(monitor, "platform", NULL);
-        udev_monitor_filter_add_match_subsystem_devtype(monitor, "machinecheck", NULL);
-        udev_monitor_enable_receiving(monitor);
+        if (fd >= 0) {
+            this->inputFds.push_back(fd);
+        }
+    }
 
-        int fd = udev_monitor_get_fd(monitor);
+    /*
+     * Nothing is queued or running on the workers. Must be called with
+     * the dispatch lock held.
+     */
+    bool PowerManagement::ACPI::idle(const void *except) const {
 
-        fd_set set;
-        struct timeval tv;
+        if (this->readyHead != nullptr) {
+            return false;
+        }
 
-        tv.tv_sec = INT_MAX;
-        tv.tv_usec = 0;
+        for (size_t slot = 0; slot < this->workerSlots; slot++) {
+            if (this->invocations[slot].entry != nullptr && &this->invocations[slot] != except) {
+                return false;
+            }
+        }
 
-        struct udev_device *device;
+        return true;
+    }
 
-        int ret;
+    bool PowerManagement::ACPI::stop(unsigned int timeout, ACPIStopPolicy policy) {
 
-        ACPIEvent event = ACPIEvent::UNKNOWN;
-        bool enteringS3S4 = false;
+        /* wakes the event thread through its eventfd if nobody else uses it */
+        stopListening();
 
-        while (acpiClass->udev_running) {
+        /* counted from here, the listener may have waited for the event thread */
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
 
-            FD_ZERO(&set);
-            FD_SET(fd, &set);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long) (timeout % 1000) * 1000000l;
 
-            ret = select(fd + 1, &set, NULL, NULL, &tv);
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
 
-            if (ret > 0 && FD_ISSET(fd, &set)) {
+        /* a worker handler calling this does not wait for itself */
+        const void *self = nullptr;
 
-                device = udev_monitor_receive_device(monitor);
+        for (size_t slot = 0; slot < ACPI_WORKERS; slot++) {
+            if (currentInvocation == &this->invocations[slot]) {
+                self = currentInvocation;
+            }
+        }
 
-                if (device == NULL) {
-#ifdef DEBUG
-                    printf("udev: the device is null\n");
-#endif
-                    continue;
-                }
+        pthread_mutex_lock(&this->dispatchLock);
 
-                /*
-                 * The /sys/devices/platform/dock.2 path is the main ThinkPad
-                 * dock device file on XX20 series ThinkPads, other ThinkPads
-                 * have not been tested as I don't have the hardware to test.
-                 */
-                if (strstr(udev_device_get_syspath(device), IBM_DOCK) != NULL) {
+        ACPIPreSleepReport report;
+        bool slept = false;
 
-                    /*
-                     * One could argue that I can use this instead of reading the
-                     * file manually but this just plainly does not work, it returns
-                     * what it feels like of returning
-                     */
-                    // const char *docked = udev_device_get_sysattr_value(device, "docked");
+        if (policy == STOP_CANCEL) {
 
-                    Hardware::Dock dock;
+            /* the queues of the waiting handlers */
+            for (HandlerEntry *entry = this->readyHead; entry != nullptr; entry = entry->nextReady) {
+                slept |= preSleepDropped(entry, entry->queueHead, entry->queueLength, report);
+                this->queueCounters.cancelled += entry->queueLength;
+                entry->inflight -= entry->queueLength;
+                entry->queueLength = 0;
+                entry->ready = false;
+            }
 
-                    if (!dock.probe()) {
-                        fprintf(stderr, "fixme: udev event fired on non-sane dock\n");
-                        udev_device_unref(device);
-                        continue;
-                    }
+            this->readyHead = nullptr;
+            this->readyTail = nullptr;
 
-                    /* Wait for the dock to appear */
-                    sleep(1);
+            /* and of the serial handlers that are running */
+            for (size_t slot = 0; slot < this->workerSlots; slot++) {
 
-                    event = dock.isDocked() ? ACPIEvent::DOCKED : ACPIEvent::UNDOCKED;
+                HandlerEntry *entry = this->invocations[slot].entry;
 
+                if (entry != nullptr) {
+                    slept |= preSleepDropped(entry, entry->queueHead, entry->queueLength, report);
+                    this->queueCounters.cancelled += entry->queueLength;
+                    entry->inflight -= entry->queueLength;
+                    entry->queueLength = 0;
                 }
+            }
+        }
 
-                /*
-                 * When the system is suspending, Linux switches off all CPU cores
-                 * but one, and this change is reflected in the sysfs with the
-                 * removal/addition of the machinecheck files. We intercept these
-                 * changes and act upon them
-                 */
-                if (strstr(udev_device_get_syspath(device), SYSFS_MACHINECHECK) != NULL) {
+        /* the sleep goes on without the cancelled pre-sleep handlers */
+        if (slept) {
+            pthread_mutex_unlock(&this->dispatchLock);
+            reportPreSleep(report);
+            pthread_mutex_lock(&this->dispatchLock);
+        }
 
-                    const char *action = udev_device_get_action(device);
+        bool stopped = true;
 
-                    if (strcmp(action, "remove") == 0) {
+        while (!idle(self)) {
+            if (pthread_cond_timedwait(&this->invocationDone, &this->dispatchLock, &deadline) == ETIMEDOUT) {
+                stopped = idle(self);
+                break;
+            }
+        }
 
-                        /**
-                         * Each core except for CPU0 is brought down
-                         * and then up again, we debounce this with
-                         * only one event.
-                         */
-                        if (enteringS3S4) continue;
+        pthread_mutex_unlock(&this->dispatchLock);
 
-                        event = ACPIEvent::POWER_S3S4_ENTER;
-                        enteringS3S4 = true;
-                    }
+        if (!stopped) {
+            fprintf(stderr, "ACPI handlers still running after %u ms\n", timeout);
+            return false;
+        }
+
+        /* a worker can not join itself, the workers are left for the next stop() */
+        if (self == nullptr) {
+            stopWorkers();
+        }
 
-                    if (strcmp(action, "add") == 0) {
+        return true;
+    }
 
-                        if (!enteringS3S4) continue;
+    void PowerManagement::ACPI::wait() {
+        pthread_mutex_lock(&this->listenLock);
 
-                        event = ACPIEvent::POWER_S3S4_EXIT;
-                        enteringS3S4 = false;
-                    }
+        while (this->listening) {
+            pthread_cond_wait(&this->listenDone, &this->listenLock);
+        }
 
-                }
+        pthread_mutex_unlock(&this->listenLock);
+    }
 
-                for (ACPIEventHandler* acpihandler : *acpiClass->ACPIhandlers) {
+    void PowerManagement::ACPI::start()
+    {
+        /* the host drives a polled instance */
+        if (this->polling) return;
 
-                    pthread_t handler;
+        /* start the handler workers */
+        startWorkers();
 
-                    ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+        /* listen on acpid and udev, shared with the other instances */
+        if (this->source == nullptr) {
 
-                    metadata->handler = acpihandler;
-                    metadata->event = event;
+            /* before subscribing, a failing reactor resets it */
+            pthread_mutex_lock(&this->listenLock);
+            this->listening = true;
+            pthread_mutex_unlock(&this->listenLock);
 
+            this->source = EventSource::acquire(this);
 
-                    pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata);
-                    pthread_detach(handler);
+            if (this->source == nullptr) {
+                pthread_mutex_lock(&this->listenLock);
+                this->listening = false;
+                pthread_cond_broadcast(&this->listenDone);
+                pthread_mutex_unlock(&this->listenLock);
+            }
+        }
+    }
 
+    /********************** Utilities::Ini *******************/
 
-                }
+    Utilities::Ini::Ini::~Ini()
+    {
+        if (sections == nullptr) return;
+
+        for (IniSection* section : *sections) {
+            delete section;
+        }
+
+        delete sections;
+    }
 
-                event = ACPIEvent::UNKNOWN;
-                udev_device_unref(device);
+    /*
+     * The ini tokenizer does not walk the file byte by byte. Instead, a
+     * scanner produces a structural index: the offsets of every '\n', '[',
+     * ']' and '=' in the file, in order. The parser then jumps from one
+     * structural character to the next and copies the bytes in between
+     * in one go.
+     *
+     * The file is indexed in blocks of INI_BLOCK bytes so the index stays
+     * small and hot in the cache while the parser consumes it.
+     *
+     * The scanner is picked once at load time, AVX2 or SSE2 when the CPU
+     * has them and a plain scalar loop otherwise.
+     */
+
+#define INI_BLOCK 4096
+#define INI_SLACK 4
+
+    /*
+     * Scanners store the offsets relative to buf into index, which
+     * must have room for len + INI_SLACK entries, and return the
+     * number stored
+     */
+    typedef size_t (*IniScanner)(const char *buf, size_t len, uint32_t *index);
+
+    static size_t iniScanScalar(const char *buf, size_t len, uint32_t *index)
+    {
+        /* 1 for the structural characters, branch free on the hot path */
+        static const struct IniStructuralTable {
+            uint8_t is[256];
+            IniStructuralTable() : is() {
+                is[(uint8_t) '\n'] = is[(uint8_t) '['] = is[(uint8_t) ']'] = is[(uint8_t) '='] = 1;
             }
+        } table;
 
-        }
+        size_t count = 0;
 
-        return nullptr;
+        for (size_t i = 0; i < len; i++) {
+            index[count] = (uint32_t) i;
+            count += table.is[(uint8_t) buf[i]];
+        }
 
+        return count;
     }
 
-    PowerManagement::ACPI::ACPI() : ACPIhandlers(new vector<ACPIEventHandler*>)
+#if defined(__x86_64__) || defined(__i386__)
+
+    /*
+     * Turn the set bits of mask into offsets. This always writes in
+     * groups of four so the loop is mostly free of mispredicted
+     * branches, the index has INI_SLACK entries of room for that.
+     */
+    static inline size_t iniFlatten(uint32_t *index, uint32_t base, unsigned int mask)
     {
+        size_t count = (size_t) __builtin_popcount(mask);
+
+        while (mask != 0) {
+            index[0] = base + __builtin_ctz(mask);
+            mask &= mask - 1;
+            index[1] = base + __builtin_ctz(mask | 0x80000000u);
+            mask &= mask - 1;
+            index[2] = base + __builtin_ctz(mask | 0x80000000u);
+            mask &= mask - 1;
+            index[3] = base + __builtin_ctz(mask | 0x80000000u);
+            mask &= mask - 1;
+            index += 4;
+        }
 
+        return count;
     }
 
-    PowerManagement::ACPI::~ACPI()
+    __attribute__((target("sse2")))
+    static size_t iniScanSSE2(const char *buf, size_t len, uint32_t *index)
     {
+        const __m128i nl = _mm_set1_epi8('\n');
+        const __m128i open = _mm_set1_epi8('[');
+        const __m128i close = _mm_set1_epi8(']');
+        const __m128i eq = _mm_set1_epi8('=');
 
-        this->udev_running = false;
+        size_t count = 0;
+        size_t i = 0;
 
-        if (acpid_listener > 0) {
-            pthread_cancel(acpid_listener);
-            pthread_join(acpid_listener, NULL);
-        }
+        for (; i + 16 <= len; i += 16) {
 
-        if (udev_listener > 0) {
-            pthread_cancel(udev_listener);
-            pthread_join(udev_listener, NULL);
+            __m128i chunk = _mm_loadu_si128((const __m128i*) (buf + i));
+
+            __m128i hits = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, nl), _mm_cmpeq_epi8(chunk, open)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, close), _mm_cmpeq_epi8(chunk, eq)));
+
+            unsigned int mask = (unsigned int) _mm_movemask_epi8(hits);
+
+            count += iniFlatten(index + count, (uint32_t) i, mask);
         }
 
-        delete this->ACPIhandlers;
+        /* the tail is shorter than a vector */
+        size_t tail = iniScanScalar(buf + i, len - i, index + count);
 
-    }
+        for (size_t j = count; j < count + tail; j++) {
+            index[j] += (uint32_t) i;
+        }
 
-    void PowerManagement::ACPI::addEventHandler(PowerManagement::ACPIEventHandler *handler) {
-        this->ACPIhandlers->push_back(handler);
+        return count + tail;
     }
 
-    void PowerManagement::ACPI::wait() {
-        pthread_join(acpid_listener, NULL);
-        pthread_join(udev_listener, NULL);
+    __attribute__((target("avx2")))
+    static size_t iniScanAVX2(const char *buf, size_t len, uint32_t *index)
+    {
+        const __m256i nl = _mm256_set1_epi8('\n');
+        const __m256i open = _mm256_set1_epi8('[');
+        const __m256i close = _mm256_set1_epi8(']');
+        const __m256i eq = _mm256_set1_epi8('=');
+
+        size_t count = 0;
+        size_t i = 0;
+
+        for (; i + 32 <= len; i += 32) {
+
+            __m256i chunk = _mm256_loadu_si256((const __m256i*) (buf + i));
+
+            __m256i hits = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, nl), _mm256_cmpeq_epi8(chunk, open)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, close), _mm256_cmpeq_epi8(chunk, eq)));
+
+            unsigned int mask = (unsigned int) _mm256_movemask_epi8(hits);
+
+            count += iniFlatten(index + count, (uint32_t) i, mask);
+        }
+
+        /* the tail is shorter than a vector */
+        size_t tail = iniScanScalar(buf + i, len - i, index + count);
+
+        for (size_t j = count; j < count + tail; j++) {
+            index[j] += (uint32_t) i;
+        }
+
+        return count + tail;
     }
 
-    void PowerManagement::ACPI::start()
+#endif
+
+    static IniScanner iniSelectScanner()
     {
-        /* start the acpid event listener */
-        pthread_create(&acpid_listener, NULL, handle_acpid, this);
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
 
-        /* start the udev event listener */
-        pthread_create(&udev_listener, NULL, handle_udev, this);
-    }
+        if (__builtin_cpu_supports("avx2"))
+            return iniScanAVX2;
 
-    void *PowerManagement::ACPIEventHandler::_handleEvent(void* _this) {
-        ACPIEventMetadata *metadata = (ACPIEventMetadata*) _this;
-        metadata->handler->handleEvent(metadata->event);
-        free(metadata);
-        return nullptr;
+        if (__builtin_cpu_supports("sse2"))
+            return iniScanSSE2;
+#endif
+        return iniScanScalar;
     }
 
+    static const IniScanner iniScan = iniSelectScanner();
 
-    /********************** Utilities::Ini *******************/
+    /*
+     * The structural index of a file, filled one block at a time
+     */
+    class IniStructurals {
 
-    Utilities::Ini::Ini::~Ini()
-    {
-        if (sections == nullptr) return;
+        const char *file;
+        const size_t size;
 
-        for (IniSection* section : *sections) {
-            delete section;
+        uint32_t index[INI_BLOCK + INI_SLACK];
+        size_t base = 0;
+        size_t count = 0;
+        size_t pos = 0;
+        size_t scanned = 0;
+
+    public:
+
+        IniStructurals(const char *file, size_t size) : file(file), size(size) {}
+
+        /*
+         * Find the next structural character c at or after the offset
+         * from, or return the size of the file if there is none. The
+         * offsets passed in must never go backwards.
+         */
+        size_t next(char c, size_t from)
+        {
+            while (true) {
+
+                while (pos < count) {
+                    size_t offset = base + index[pos];
+                    if (offset >= from && file[offset] == c)
+                        return offset;
+                    pos++;
+                }
+
+                if (scanned >= size)
+                    return size;
+
+                base = scanned;
+                count = iniScan(file + base, std::min(size - base, (size_t) INI_BLOCK), index);
+                pos = 0;
+                scanned = std::min(size, base + INI_BLOCK);
+            }
         }
+    };
+
+    /*
+     * Copy [begin, end) into a key/value/name buffer, truncating whatever
+     * does not fit. The copy is always the full size of the buffer, which
+     * the compiler turns into a few wide moves instead of a memcpy call,
+     * so the file buffer is padded with INI_PAD bytes for the overread.
+     */
+#define INI_PAD 128
+
+    template<size_t N>
+    static inline void iniCopy(char (&dst)[N], const char *begin, const char *end)
+    {
+        static_assert(N <= INI_PAD, "ini field larger than the read padding");
 
-        delete sections;
+        memcpy(dst, begin, N);
+        dst[std::min((size_t) (end - begin), N - 1)] = 0;
     }
 
     vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIni(std::string path)
@@ -534,28 +5227,40 @@ namespace ThinkPad {
             return nullptr;
         }
 
+        const size_t size = (size_t) buf.st_size;
+        std::unique_ptr<char[]> contents(new char[size + INI_PAD]);
+        memset(contents.get() + size, 0, INI_PAD);
 
-        char file[buf.st_size];
+        for (size_t done = 0; done < size; ) {
 
-        if (read(fd, file,  buf.st_size) != buf.st_size) {
-            fprintf(stderr, "config: read failed: %s\n", strerror(errno));
-            close(fd);
-            return nullptr;
+            ssize_t bytesRead = read(fd, contents.get() + done, size - done);
+
+            if (bytesRead <= 0) {
+                fprintf(stderr, "config: read failed: %s\n", strerror(errno));
+                close(fd);
+                return nullptr;
+            }
+
+            done += (size_t) bytesRead;
         }
 
         close(fd);
 
-        for(unsigned int i = 0; i < sizeof(file); i++) {
+        const char *file = contents.get();
+        IniStructurals structurals(file, size);
+
+        size_t i = 0;
 
-            continue_outer:
+        while (i < size) {
 
             /* skip leading whitespaces */
-            while (file[i] == '\n') {
+            while (i < size && file[i] == '\n') {
                 i++;
-                if (i >= sizeof(file))
-                    goto break_outer;
             }
 
+            if (i >= size)
+                break;
+
             if (file[i] != '[') {
                 printf("config: unexpected token: %c\n", file[i]);
                 break;
@@ -563,91 +5268,81 @@ namespace ThinkPad {
 
             /* skip '[' */
             i++;
-            if (i >= sizeof(file)) {
+            if (i >= size) {
                 printf("config: unexpected EOF\n");
-                goto break_outer;
+                break;
+            }
+
+            size_t end = structurals.next(']', i);
+
+            if (end >= size) {
+                printf("config: unclosed ]\n");
+                break;
             }
 
             IniSection *section = new IniSection;
             section->keypairs = new vector<IniKeypair*>;
 
-            char *ptr = section->name;
-
-            while (file[i] != ']') {
-                *ptr = file[i];
-                ptr++;
-                i++;
-                if (i >= sizeof(file)) {
-                    printf("config: unclosed ]\n");
-                    goto break_outer;
-                }
-            }
+            iniCopy(section->name, file + i, file + end);
 
             /* skip ']' */
-            i++;
-            if (i >= sizeof(file)) {
+            i = end + 1;
+            if (i >= size) {
                 printf("config: unexpected EOF\n");
-                goto break_outer;
+                delete section;
+                break;
             }
 
+            bool failed = false;
+
             while (true) {
 
                 /* skip leading whitespaces */
-                while (file[i] == '\n') {
+                while (i < size && file[i] == '\n') {
                     i++;
-                    if (i >= sizeof(file)) {
-                        this->sections->push_back(section);
-                        goto break_outer;
-                    }
                 }
 
-                /* a new section is there */
-                if (file[i] == '[') {
+                /* EOF or a new section is there */
+                if (i >= size || file[i] == '[') {
                     this->sections->push_back(section);
-                    if (i >= sizeof(file))
-                        goto break_outer;
-                    goto continue_outer;
+                    break;
                 }
 
-                IniKeypair* keypair = new IniKeypair;
-                ptr = keypair->key;
-
-                while (file[i] != '=') {
-                    *ptr = file[i];
-                    ptr++;
-                    i++;
-                    if (i >= sizeof(file)) {
-                        printf("config: unexpected EOF, expected '='\n");
-                        goto break_outer;
-                    }
-                }
+                end = structurals.next('=', i);
 
-                /* skip '=' */
-                i++;
-                if (i >= sizeof(file)) {
+                /* '=' must not be the last character either */
+                if (end + 1 >= size) {
                     printf("config: unexpected EOF, expected '='\n");
-                    goto break_outer;
+                    failed = true;
+                    break;
                 }
 
-                ptr = keypair->value;
+                IniKeypair* keypair = new IniKeypair;
+                iniCopy(keypair->key, file + i, file + end);
 
-                while (file[i] != '\n') {
-                    *ptr = file[i];
-                    ptr++;
-                    i++;
-                    if (i >= sizeof(file)) {
-                        printf("config: unexpected EOF\n");
-                        goto break_outer;
-                    }
+                /* skip '=' */
+                i = end + 1;
+                end = structurals.next('\n', i);
+
+                if (end >= size) {
+                    printf("config: unexpected EOF\n");
+                    delete keypair;
+                    failed = true;
+                    break;
                 }
 
+                iniCopy(keypair->value, file + i, file + end);
                 section->keypairs->push_back(keypair);
 
+                i = end;
             }
 
+            if (failed) {
+                delete section;
+                break;
+            }
         }
 
-        break_outer:
         return this->sections;
 
     }
@@ -899,6 +5594,24 @@ namespace ThinkPad {
     /******************** ThinkLight **********************/
 
     bool Hardware::ThinkLight::isOn()
+    {
+        HardwareState state;
+        if (HardwareCache::get(state)) {
+            return state.thinkLightOn;
+        }
+        return readOn();
+    }
+
+    bool Hardware::ThinkLight::probe()
+    {
+        HardwareState state;
+        if (HardwareCache::get(state)) {
+            return state.thinkLightPresent;
+        }
+        return readProbe();
+    }
+
+    bool Hardware::ThinkLight::readOn()
     {
         int fd = open(SYSFS_THINKLIGHT, O_RDONLY);
         if (fd < 0) {
@@ -920,13 +5633,13 @@ namespace ThinkPad {
 
     }
 
-    bool Hardware::ThinkLight::probe()
+    bool Hardware::ThinkLight::readProbe()
     {
         int fd = open(SYSFS_THINKLIGHT, O_RDONLY);
         if (fd < 0) {
-            close(fd);
             return false;
         }
+        close(fd);
         return true;
     }
 
@@ -947,9 +5660,22 @@ namespace ThinkPad {
             setBrightness(Backlight::System::NVIDIA, (int) setf);
         }
 
+        /* the cache does not wait for a uevent of the write */
+        if (cachedHardware.keepers.load() > 0) {
+            cachedHardware.backlight.store(readBacklightLevel(), std::memory_order_relaxed);
+        }
+
     }
 
     float Hardware::Backlight::getBacklightLevel() {
+        HardwareState state;
+        if (HardwareCache::get(state)) {
+            return state.backlight;
+        }
+        return readBacklightLevel();
+    }
+
+    float Hardware::Backlight::readBacklightLevel() {
 
          // First try the Intel backlight system
 
@@ -1137,10 +5863,14 @@ namespace ThinkPad {
 
         char *buf = (char*) calloc(sizeof(char), (size_t) filestat.st_size);
 
-        if (read(fd, buf, (size_t) filestat.st_size) < 0) {
+        ssize_t length = read(fd, buf, (size_t) filestat.st_size);
+
+        if (length < 0) {
             fprintf(stderr, "backlight: error reading max_brightness: %s\n", strerror(errno));
         }
 
+        PROBE2(sysfs_read, path, length);
+
         close(fd);
 
         return buf;
@@ -1182,6 +5912,8 @@ namespace ThinkPad {
         memset(buf, 0, strlen);
         snprintf(buf, strlen, "%d", value);
 
+        PROBE2(sysfs_write, path, value);
+
         if (write(fd, buf, strlen) < 0) {
             fprintf(stderr, "thinkpad: error writing to file: %s\n", strerror(errno));
             return 1;
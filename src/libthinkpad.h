@@ -27,12 +27,29 @@
 #ifndef LIBTHINKDOCK_LIBRARY_H
 #define LIBTHINKDOCK_LIBRARY_H
 
-#define LIBTHINKPAD_MAJOR 2
-#define LIBTHINKPAD_MINOR 6
+#define LIBTHINKPAD_MAJOR 3
+#define LIBTHINKPAD_MINOR 0
 
 #include <string>
 #include <vector>
+#include <bitset>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <pthread.h>
+
+/* C++20 code gets the coroutine API of ACPI, see ACPIEventStream */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define LIBTHINKPAD_COROUTINES
+#include <coroutine>
+#include <deque>
+#include <memory>
+#endif
 
 #define IBM_DOCK "/sys/devices/platform/dock.2"
 #define IBM_DOCK_DOCKED     "/sys/devices/platform/dock.2/docked"
@@ -66,9 +83,16 @@
 #define ACPI_BUTTON_FNF12_HIBERNATE "button/suspend SUSP"
 
 #define ACPID_SOCK "/var/run/acpid.socket"
+#define ACPID_RECONNECT_MIN 100
+#define ACPID_RECONNECT_MAX 30000
 
 #define SYSFS_THINKLIGHT "/sys/class/leds/tpacpi::thinklight/brightness"
 #define SYSFS_MACHINECHECK "/sys/devices/system/machinecheck/machinecheck"
+#define PROC_ACPI_LID "/proc/acpi/button/lid"
+
+#define INPUT_THINKPAD_BUTTONS "ThinkPad Extra Buttons"
+#define INPUT_AT_KEYBOARD "AT Translated Set 2 keyboard"
+#define INPUT_VIDEO_BUS "Video Bus"
 
 #define SYSFS_BACKLIGHT_NVIDIA "/sys/class/backlight/nv_backlight"
 #define SYSFS_BACKLIGHT_INTEL "/sys/class/backlight/intel_backlight"
@@ -77,7 +101,18 @@
 #define SYSFS_BATTERY_SECONDARY "/sys/class/power_supply/BAT1"
 
 #define BUFSIZE 128
-#define INBUFSZ 1
+#define INBUFSZ 4096
+
+#define ACPI_WORKERS 4
+#define ACPI_HANDLER_QUEUE 64
+#define ACPI_DOCK_SETTLE 1000
+#define ACPI_CACHE_STALENESS 1000
+#define ACPI_CACHE_RESYNC 60000
+#define ACPI_INLINE_BUDGET 1000
+#define ACPI_LATENCY_BUCKETS 312
+#define ACPI_POLL_RING 256
+#define ACPI_UDEV_BUFFER (1024 * 1024)
+#define ACPI_REPLAY_BATCH 64
 
 using std::string;
 using std::vector;
@@ -85,22 +120,91 @@ using std::vector;
 typedef int SUSPEND_REASON;
 typedef int STATUS;
 
+struct udev;
+struct udev_monitor;
+struct udev_device;
+
 /**
  * @brief The main libthinkpad interface. This contains all the libthinkpad features.
  */
 namespace ThinkPad {
 
+    namespace PowerManagement {
+        class ACPI;
+    }
+
     /**
      * @brief This namespace handles ThinkPad hardware, such as docks, lights and batteries.
      */
     namespace Hardware {
 
+        /**
+         * @brief The state of the hardware as the HardwareCache has it
+         */
+        struct HardwareState {
+            bool dockPresent;           /* Dock::probe() */
+            bool docked;                /* Dock::isDocked() */
+            bool thinkLightPresent;     /* ThinkLight::probe() */
+            bool thinkLightOn;          /* ThinkLight::isOn() */
+            float backlight;            /* Backlight::getBacklightLevel() */
+            bool batteryPresent[2];     /* BAT0 and BAT1 */
+            uint64_t updated;           /* when it was last known current, CLOCK_MONOTONIC nanoseconds */
+        };
+
+        /**
+         * @brief The HardwareCache keeps the state of the dock, the
+         * ThinkLight, the backlight and the batteries in memory
+         *
+         * It is kept by the ACPI instances with setHardwareCache().
+         * While one of them runs, the getters of Dock, ThinkLight and
+         * Backlight read memory instead of sysfs. It is read in full
+         * once, after that a device is only read again when udev
+         * reports a change of it, and the backlight when it is set
+         * through Backlight. The ThinkLight does not announce itself,
+         * it alone is read every ACPI_CACHE_STALENESS / 2 milliseconds.
+         *
+         * The changes udev reports and the ThinkLight are never older
+         * than ACPI_CACHE_STALENESS milliseconds. When the cache was not
+         * kept in that time, because no instance keeps it anymore or a
+         * polled one is not polled, the getters read sysfs until it is.
+         * In case udev lost a change, everything is read again when its
+         * buffer overflows and every ACPI_CACHE_RESYNC milliseconds.
+         */
+        class HardwareCache {
+
+            friend class PowerManagement::ACPI;
+
+        public:
+
+            /**
+             * @brief Get the cached state of the hardware
+             * @param state filled in with the state
+             * @return false if the cache is older than ACPI_CACHE_STALENESS,
+             * state is left alone then
+             */
+            static bool get(HardwareState &state);
+
+        private:
+
+            static void attach();
+            static void detach();
+            static void refresh();
+            static void refresh(const char *syspath);
+            static void tick();
+
+        };
+
         /**
          * @brief The Dock class is used to probe for the dock
          * validity and probe for basic information about the dock.
          */
         class Dock {
 
+            friend class HardwareCache;
+
+            bool readDocked();
+            bool readProbe();
+
         public:
 
             /**
@@ -125,6 +229,12 @@ namespace ThinkPad {
          * and validity
          */
         class ThinkLight {
+
+            friend class HardwareCache;
+
+            bool readOn();
+            bool readProbe();
+
         public:
             /**
              * @brief check if the ThinkLight is currently on
@@ -155,6 +265,10 @@ namespace ThinkPad {
             int getCurrentBrightness(System system);
             void setBrightness(System system, int value);
 
+            friend class HardwareCache;
+
+            float readBacklightLevel();
+
         public:
 
             /**
@@ -246,6 +360,18 @@ namespace ThinkPad {
         class ACPIEventHandler;
         class ACPI;
 
+#ifdef LIBTHINKPAD_COROUTINES
+
+        class ACPIEventAwaiter;
+
+        /**
+         * @brief Resumes a coroutine waiting for an ACPI event, for
+         * example by posting it to the event loop the coroutine runs on
+         */
+        typedef std::function<void(std::coroutine_handle<>)> ACPIExecutor;
+
+#endif
+
         /**
          * @brief Varoius ACPI events that can occur on the ThinkPad
          */
@@ -358,124 +484,1720 @@ namespace ThinkPad {
         };
 
         /**
-         * @brief this defines the reason why a system suspend was requested
+         * @brief The number of different ACPI events
          */
-        enum SuspendReason {
-            LID,
-            BUTTON
-        };
+        static const size_t ACPIEventCount = BUTTON_BRIGHTNESS_UP + 1;
 
         /**
-         * @brief Private internal API metada, do not use
+         * A set of ACPI events, indexed by ACPIEvent. A handler is only
+         * called for the events set in the mask it was added with, e.g.
+         * ACPIEventMask().set(LID_CLOSED).set(LID_OPENED)
+         *
+         * @brief The events an ACPI event handler subscribes to
          */
-        struct _ACPIEventMetadata {
-            ACPIEvent event;
-            ACPIEventHandler *handler;
+        typedef std::bitset<ACPIEventCount> ACPIEventMask;
+
+        /**
+         * @brief How the invocations of a handler are scheduled on the
+         * ACPI worker threads
+         */
+        enum ACPIDispatchMode {
+
+            /**
+             * Events are handled as soon as a worker is free, so the
+             * handler can run several times at once and see events
+             * out of order
+             */
+            DISPATCH_PARALLEL,
+
+            /**
+             * Events are handled one at a time, in the order they
+             * occured. Different handlers still run in parallel.
+             */
+            DISPATCH_SERIAL,
+
+            /**
+             * Events are handled right away on the ACPI event thread,
+             * in order and without queueing. Only for handlers that
+             * return almost immediately, every other event waits for
+             * them. See ACPI::setInlineBudget.
+             */
+            DISPATCH_INLINE
         };
 
-        typedef struct _ACPIEventMetadata ACPIEventMetadata;
+        /**
+         * @brief What happens when a DISPATCH_INLINE handler takes longer
+         * than the inline time budget
+         */
+        enum ACPIInlinePolicy {
+
+            /**
+             * A warning is printed and the handler stays inline
+             */
+            INLINE_WARN,
+
+            /**
+             * A warning is printed and the handler is moved to the
+             * workers as a DISPATCH_SERIAL handler for good
+             */
+            INLINE_DEMOTE
+        };
 
         /**
-         * The power state manager is used to request power
-         * state changes to the system. You can request the system
-         * to suspend only currently.
+         * Every handler has a queue of at most ACPI_HANDLER_QUEUE events
+         * that are waiting to be handled. The policy decides what happens
+         * to new events when the handler can't keep up.
          *
-         * @brief Class for hardware power management
+         * @brief What to do when the event queue of a handler is full
          */
-        class PowerStateManager {
+        enum ACPIOverflowPolicy {
 
-        private:
+            /**
+             * The new event is dropped
+             */
+            OVERFLOW_DROP_NEWEST,
 
             /**
-            * Calling this method suspends the ThinkPad without any
-            * further questions
-            * @return true if the suspend succeeded
-            */
-            static bool suspend();
+             * The oldest queued event is dropped to make room
+             */
+            OVERFLOW_DROP_OLDEST,
 
-        public:
             /**
-            * Request a suspend of the system. You need to specify a suspend
-            * reason, whether it is the lid or the user pressing the button.
-            * This should be called in an ACPI event handler.
-            * @param reason the reason for the suspend, lid or button
-            * @return true if the suspend was successful
-            */
-            static bool requestSuspend(SuspendReason reason);
+             * An event identical to the last queued one is merged into
+             * it and delivered once with a repeat count, even when the
+             * queue is not full. Other events drop the oldest one.
+             */
+            OVERFLOW_COALESCE
+        };
+
+        /**
+         * @brief What ACPI::stop does with the events still queued
+         */
+        enum ACPIStopPolicy {
+
+            /**
+             * The queued events are handled before stopping
+             */
+            STOP_DRAIN,
 
+            /**
+             * The queued events are dropped, only the invocations
+             * already running are waited for
+             */
+            STOP_CANCEL
         };
 
         /**
-         * The ACPI class is used for power event monitoring
-         * and reporting. It combines the functionality from
-         * udev and acpid into a single API to be used by applications.
+         * @brief Counters of the handler event queues of an ACPI instance
+         */
+        struct ACPIQueueCounters {
+
+            /**
+             * Events queued on a handler
+             */
+            unsigned long queued;
+
+            /**
+             * Events dropped because a queue was full
+             */
+            unsigned long overflowed;
+
+            /**
+             * Events merged into the previous identical event
+             */
+            unsigned long coalesced;
+
+            /**
+             * Queued events dropped by ACPI::stop with STOP_CANCEL
+             */
+            unsigned long cancelled;
+        };
+
+        /**
+         * @brief The stages of handling an event that are timed when the
+         * ACPI statistics are enabled
+         */
+        enum ACPILatencyStage {
+
+            /**
+             * From receiving the acpid line or udev device until it was
+             * turned into an ACPIEvent
+             */
+            LATENCY_CLASSIFY,
+
+            /**
+             * From the classification until the event was queued for the
+             * handlers, including the time held back by an event filter
+             */
+            LATENCY_FILTER,
+
+            /**
+             * From queueing the event until a handler started handling it
+             */
+            LATENCY_QUEUE,
+
+            /**
+             * The time a handler took to handle the event
+             */
+            LATENCY_HANDLER,
+
+            /**
+             * From receiving the event until a handler started handling it
+             */
+            LATENCY_DELIVERY
+        };
+
+        /**
+         * @brief The number of timed stages
+         */
+        static const size_t ACPILatencyStageCount = LATENCY_DELIVERY + 1;
+
+        /**
+         * The latencies are counted in ACPI_LATENCY_BUCKETS buckets. The
+         * first 8 are exact nanoseconds, after that every power of two is
+         * split into 8 buckets, so a bucket is at most 12.5% wide. The
+         * last one also holds everything above 2^41 ns.
          *
-         * @brief This handles the system power state and ACPI event dispatches.
+         * @brief A latency histogram of one stage of one event
          */
-        class ACPI {
-        private:
+        struct ACPILatency {
 
-            static void *handle_acpid(void*);
-            static void *handle_udev(void*);
+            /**
+             * The number of latencies recorded
+             */
+            unsigned long long count;
 
-            static pthread_t acpid_listener;
-            static pthread_t udev_listener;
+            /**
+             * The sum of the latencies in nanoseconds
+             */
+            unsigned long long sum;
 
-            vector<ACPIEventHandler*> *ACPIhandlers;
+            /**
+             * The largest latency in nanoseconds
+             */
+            unsigned long long max;
 
-            bool udev_running = true;
+            /**
+             * The number of latencies in every bucket
+             */
+            unsigned long long buckets[ACPI_LATENCY_BUCKETS];
 
-        public:
+            /**
+             * @brief The smallest latency of a bucket
+             * @param bucket the bucket
+             * @return the latency in nanoseconds
+             */
+            static unsigned long long bucketFloor(size_t bucket);
 
-            ACPI();
-            ~ACPI();
+            /**
+             * @brief The bucket a latency is counted in
+             * @param latency the latency in nanoseconds
+             * @return the bucket
+             */
+            static size_t bucketOf(unsigned long long latency);
 
             /**
-             * @brief Set a custom event handler for ACPI events
-             *
-             * @param handler
+             * @brief Estimate a percentile of the latencies
+             * @param percentile the percentile, between 0 and 100
+             * @return the upper end of the bucket the percentile falls in,
+             * in nanoseconds, or 0 if nothing was recorded
              */
-            void addEventHandler(ACPIEventHandler *handler);
+            unsigned long long percentile(double percentile) const;
+        };
+
+        /**
+         * The histograms are read one by one while events keep coming in,
+         * so they can be off by the events handled during the read.
+         *
+         * @brief A snapshot of the ACPI latency histograms
+         */
+        struct ACPIStats {
 
             /**
-             * @brief Block the caller of the method for infinite-loop
-             * exit-prevention. Used for testing.
+             * The histograms of every event and stage
              */
-            void wait();
+            std::vector<ACPILatency> latency;
 
             /**
-             * @brief starts the listening on ACPI events
+             * @brief Get the histogram of one stage of one event
+             * @param event the event
+             * @param stage the stage
+             * @return the histogram
              */
-            void start();
+            const ACPILatency &get(ACPIEvent event, ACPILatencyStage stage) const {
+                return latency[event * ACPILatencyStageCount + stage];
+            }
         };
 
+        /**
+         * All counters only ever grow, from the creation of the ACPI
+         * instance on. They are read one by one, so a snapshot taken
+         * while events come in may be off by those events.
+         *
+         * @brief A snapshot of the ACPI runtime counters
+         */
+        struct ACPIMetrics {
+
+            /**
+             * Events received per type, before any event filter
+             */
+            unsigned long long received[ACPIEventCount];
+
+            /**
+             * Handler invocations per event type
+             */
+            unsigned long long invocations[ACPIEventCount];
+
+            /**
+             * Handler invocations that ended with an exception, per event type
+             */
+            unsigned long long failures[ACPIEventCount];
+
+            /**
+             * acpid lines and kernel events that did not match any
+             * known event
+             */
+            unsigned long long unknownLines;
+
+            /**
+             * acpid lines that were too long and purged
+             */
+            unsigned long long purgedLines;
+
+            /**
+             * udev devices that did not lead to an event
+             */
+            unsigned long long udevIgnored;
+
+            /**
+             * Times the udev receive buffer overflowed and the kernel
+             * dropped devices, see ACPI_UDEV_BUFFER
+             */
+            unsigned long long udevOverflows;
+
+            /**
+             * Times the acpid connection was established again after
+             * it was lost or could not be made
+             */
+            unsigned long long reconnects;
+
+            /**
+             * Handler invocations that went over the budget of their
+             * handler, per event type
+             */
+            unsigned long long overruns[ACPIEventCount];
+
+            /**
+             * Events not handed to a handler because it was quarantined
+             */
+            unsigned long long quarantined;
+
+            /**
+             * Events dropped because the ring of a polled instance was
+             * full, see ACPI::startPolling
+             */
+            unsigned long long pollOverflowed;
+        };
 
         /**
-         * @brief This is the abstract ACPI event handler class.
+         * Events of one type often come in bursts, a bouncing lid switch
+         * or the dock reporting itself several times. A filter collapses
+         * such a burst before the event reaches any handler. Events that
+         * are less than interval milliseconds apart belong to the same
+         * burst, and the burst ends once no event came for interval
+         * milliseconds.
          *
-         * If you want to use this class, override the handleEvent(ACPIEvent)
-         * method and do your thing there. The method is called from another thread
-         * so watch out for threading issues that might occur.
+         * Without leading or trailing set, the leading edge is delivered.
+         * The default filter of every event does nothing.
          *
-         * If you need to
-         * use shared resources inside the handler, use the pthread mutex API.
+         * @brief How the events of one type are debounced and rate limited
          */
-        class ACPIEventHandler {
-        public:
+        struct ACPIEventFilter {
+
             /**
-             * PRIVATE METHOD: DO NOT USE
+             * The quiet time in milliseconds that ends a burst, 0 to
+             * not debounce the event
              */
-            static void* _handleEvent(void* _this);
+            unsigned int interval;
 
             /**
-             * This method is called for various ACPI events, such
-             * as power button presses, lid events and dock events.
-             *
-             * @param event the event that occured
+             * Deliver the first event of a burst right away
              */
-            virtual void handleEvent(ACPIEvent event) = 0;
+            bool leading;
+
+            /**
+             * Deliver one event when the burst ends, if any event of the
+             * burst was not delivered yet
+             */
+            bool trailing;
+
+            /**
+             * Deliver at most this many events per second, the others
+             * are dropped. 0 for no limit.
+             */
+            unsigned int maxRate;
+        };
+
+        /**
+         * @brief Identifies a callable handler added to an ACPI instance
+         */
+        typedef unsigned long ACPIHandlerId;
+
+        /**
+         * @brief A handler invocation that went over the budget of its
+         * handler, see ACPI::setHandlerBudget
+         */
+        struct ACPIOverrun {
+
+            /**
+             * The handler that is overrunning
+             */
+            ACPIHandlerId id;
+
+            /**
+             * The handler, if it was added as an ACPIEventHandler
+             */
+            ACPIEventHandler *handler;
+
+            /**
+             * The event it is handling
+             */
+            ACPIEvent event;
+
+            /**
+             * The budget of the handler in milliseconds
+             */
+            unsigned int budget;
+
+            /**
+             * How long the invocation has been running, in milliseconds
+             */
+            unsigned long long elapsed;
+
+            /**
+             * The handler is quarantined, it is not given new events
+             * until the invocations it is running have finished
+             */
+            bool quarantined;
         };
 
+        /**
+         * @brief Called for every overrun the ACPI watchdog detects
+         */
+        typedef std::function<void(const ACPIOverrun&)> ACPIOverrunCallback;
+
+        /**
+         * @brief How long a handler took with POWER_S3S4_ENTER before the
+         * system went to sleep, see ACPI::setPreSleep
+         */
+        struct ACPIPreSleepTime {
+
+            /**
+             * The handler
+             */
+            ACPIHandlerId id;
+
+            /**
+             * The handler, if it was added as an ACPIEventHandler
+             */
+            ACPIEventHandler *handler;
+
+            /**
+             * Microseconds from PrepareForSleep until the handler
+             * returned, or until the deadline if it had not
+             */
+            unsigned long long elapsed;
+
+            /**
+             * The handler returned before the deadline
+             */
+            bool finished;
+
+            /**
+             * The event was dropped from the handler queue or cancelled
+             * by stopping before the handler ran it, elapsed is when
+             */
+            bool dropped;
+        };
+
+        /**
+         * @brief The handlers of one pre-sleep round, see ACPI::setPreSleep
+         */
+        struct ACPIPreSleepReport {
+
+            /**
+             * Microseconds from PrepareForSleep until the instance let
+             * the system sleep
+             */
+            unsigned long long elapsed;
+
+            /**
+             * The deadline passed before every handler returned
+             */
+            bool timedOut;
+
+            /**
+             * Every handler POWER_S3S4_ENTER was given to
+             */
+            vector<ACPIPreSleepTime> handlers;
+        };
+
+        /**
+         * @brief Called after every pre-sleep round
+         */
+        typedef std::function<void(const ACPIPreSleepReport&)> ACPIPreSleepCallback;
+
+        /**
+         * A type-erased callable taking an ACPIEvent, such as a lambda,
+         * a function pointer or a std::function. Callables up to four
+         * pointers in size are stored inside the object itself, larger
+         * ones once on the heap. Calling it is a plain indirect call.
+         *
+         * A callable that also takes an unsigned int gets the repeat
+         * count of coalesced events, see OVERFLOW_COALESCE.
+         *
+         * @brief A callable ACPI event handler
+         */
+        class ACPICallback {
+        public:
+
+            template<typename F>
+            explicit ACPICallback(F function) {
+
+                typedef typename std::decay<F>::type Function;
+
+                const bool fits = sizeof(Function) <= sizeof(Storage) &&
+                                  alignof(Function) <= alignof(Storage);
+
+                if (fits) {
+                    object = new (&storage) Function(std::move(function));
+                    destroy = &destroyInline<Function>;
+                } else {
+                    object = new Function(std::move(function));
+                    destroy = &destroyHeap<Function>;
+                }
+
+                call = &invoke<Function>;
+            }
+
+            ~ACPICallback() {
+                destroy(object);
+            }
+
+            ACPICallback(const ACPICallback&) = delete;
+            ACPICallback& operator=(const ACPICallback&) = delete;
+
+            void operator()(ACPIEvent event, unsigned int repeat) {
+                call(object, event, repeat);
+            }
+
+        private:
+
+            typedef std::aligned_storage<4 * sizeof(void*), alignof(std::max_align_t)>::type Storage;
+
+            Storage storage;
+            void *object;
+            void (*call)(void*, ACPIEvent, unsigned int);
+            void (*destroy)(void*);
+
+            template<typename Function>
+            static auto callWith(Function &function, ACPIEvent event, unsigned int repeat, int)
+                -> decltype(function(event, repeat), void()) {
+                function(event, repeat);
+            }
+
+            template<typename Function>
+            static void callWith(Function &function, ACPIEvent event, unsigned int, long) {
+                function(event);
+            }
+
+            template<typename Function>
+            static void invoke(void *object, ACPIEvent event, unsigned int repeat) {
+                callWith(*static_cast<Function*>(object), event, repeat, 0);
+            }
+
+            template<typename Function>
+            static void destroyInline(void *object) {
+                static_cast<Function*>(object)->~Function();
+            }
+
+            template<typename Function>
+            static void destroyHeap(void *object) {
+                delete static_cast<Function*>(object);
+            }
+        };
+
+        /**
+         * @brief Identifies a timer scheduled on an ACPI instance
+         */
+        typedef uint64_t ACPITimerId;
+
+        /**
+         * A type-erased callable taking no arguments, stored the same way
+         * as an ACPICallback. Unlike it, it can be moved and be empty.
+         *
+         * @brief A callable run by an ACPI timer
+         */
+        class ACPITimerCallback {
+        public:
+
+            ACPITimerCallback() : object(nullptr), operations(nullptr) {}
+
+            template<typename F>
+            explicit ACPITimerCallback(F function) : ACPITimerCallback() {
+
+                typedef typename std::decay<F>::type Function;
+
+                const bool fits = sizeof(Function) <= sizeof(Storage) &&
+                                  alignof(Function) <= alignof(Storage);
+
+                if (fits) {
+                    object = new (&storage) Function(std::move(function));
+                    operations = &Inline<Function>::operations;
+                } else {
+                    object = new Function(std::move(function));
+                    operations = &Heap<Function>::operations;
+                }
+            }
+
+            ACPITimerCallback(ACPITimerCallback &&other) noexcept : ACPITimerCallback() {
+                *this = std::move(other);
+            }
+
+            ACPITimerCallback& operator=(ACPITimerCallback &&other) noexcept {
+                if (this != &other) {
+                    reset();
+                    if (other.object != nullptr) {
+                        other.operations->move(other, *this);
+                    }
+                }
+                return *this;
+            }
+
+            ACPITimerCallback(const ACPITimerCallback&) = delete;
+            ACPITimerCallback& operator=(const ACPITimerCallback&) = delete;
+
+            ~ACPITimerCallback() {
+                reset();
+            }
+
+            void reset() {
+                if (object != nullptr) {
+                    operations->destroy(object);
+                    object = nullptr;
+                }
+            }
+
+            explicit operator bool() const {
+                return object != nullptr;
+            }
+
+            void operator()() {
+                operations->call(object);
+            }
+
+        private:
+
+            typedef std::aligned_storage<4 * sizeof(void*), alignof(std::max_align_t)>::type Storage;
+
+            struct Operations {
+                void (*call)(void*);
+                void (*destroy)(void*);
+                void (*move)(ACPITimerCallback &from, ACPITimerCallback &to);
+            };
+
+            Storage storage;
+            void *object;
+            const Operations *operations;
+
+            template<typename Function>
+            static void invoke(void *object) {
+                (*static_cast<Function*>(object))();
+            }
+
+            template<typename Function>
+            struct Inline {
+
+                static void destroy(void *object) {
+                    static_cast<Function*>(object)->~Function();
+                }
+
+                static void move(ACPITimerCallback &from, ACPITimerCallback &to) {
+                    to.object = new (&to.storage) Function(std::move(*static_cast<Function*>(from.object)));
+                    to.operations = from.operations;
+                    from.reset();
+                }
+
+                static const Operations operations;
+            };
+
+            template<typename Function>
+            struct Heap {
+
+                static void destroy(void *object) {
+                    delete static_cast<Function*>(object);
+                }
+
+                /* the object stays where it is */
+                static void move(ACPITimerCallback &from, ACPITimerCallback &to) {
+                    to.object = from.object;
+                    to.operations = from.operations;
+                    from.object = nullptr;
+                }
+
+                static const Operations operations;
+            };
+        };
+
+        template<typename Function>
+        const ACPITimerCallback::Operations ACPITimerCallback::Inline<Function>::operations = {
+            &ACPITimerCallback::invoke<Function>,
+            &ACPITimerCallback::Inline<Function>::destroy,
+            &ACPITimerCallback::Inline<Function>::move
+        };
+
+        template<typename Function>
+        const ACPITimerCallback::Operations ACPITimerCallback::Heap<Function>::operations = {
+            &ACPITimerCallback::invoke<Function>,
+            &ACPITimerCallback::Heap<Function>::destroy,
+            &ACPITimerCallback::Heap<Function>::move
+        };
+
+        /**
+         * @brief this defines the reason why a system suspend was requested
+         */
+        enum SuspendReason {
+            LID,
+            BUTTON
+        };
+
+        /**
+         * The power state manager is used to request power
+         * state changes to the system. You can request the system
+         * to suspend only currently.
+         *
+         * @brief Class for hardware power management
+         */
+        class PowerStateManager {
+
+        private:
+
+            /**
+            * Calling this method suspends the ThinkPad without any
+            * further questions
+            * @return true if the suspend succeeded
+            */
+            static bool suspend();
+
+        public:
+            /**
+            * Request a suspend of the system. You need to specify a suspend
+            * reason, whether it is the lid or the user pressing the button.
+            * This should be called in an ACPI event handler.
+            * @param reason the reason for the suspend, lid or button
+            * @return true if the suspend was successful
+            */
+            static bool requestSuspend(SuspendReason reason);
+
+        };
+
+        /**
+         * The ACPI class is used for power event monitoring
+         * and reporting. It combines the functionality from
+         * udev and acpid into a single API to be used by applications.
+         *
+         * @brief This handles the system power state and ACPI event dispatches.
+         */
+        class ACPI {
+        private:
+
+            struct HandlerEntry;
+            struct HandlerTable;
+            struct TimerWheel;
+            struct FilterState;
+            struct LatencyHistogram;
+            struct Counters;
+
+            /*
+             * When the event was received, classified and handed to the
+             * handler queues, 0 while the statistics are disabled
+             */
+            struct EventTimes {
+                uint64_t received;
+                uint64_t classified;
+                uint64_t enqueued;
+            };
+
+            /*
+             * The acpid connection, the udev monitor and the reactor
+             * thread, shared with the other instances of the process
+             * listening on the same acpid socket
+             */
+            struct EventSource;
+            EventSource *source = nullptr;
+
+            string acpidSocket = ACPID_SOCK;
+
+            /* take the events from the kernel instead, see setNetlinkSource */
+            bool netlinkSource = false;
+            int netlinkFd = -1;
+
+            /* read the hotkeys from the input devices too, see setInputSource */
+            bool inputSource = false;
+            vector<int> inputFds;
+
+            /* take the sleep events from logind, see setLogindSource */
+            bool logindSource = false;
+
+            /* keep the Hardware::HardwareCache, see setHardwareCache */
+            bool hardwareCache = false;
+
+            /* set while listening on a source, see wait() */
+            bool listening = false;
+            pthread_mutex_t listenLock;
+            pthread_cond_t listenDone;
+
+            /* the machinecheck files of the other cores are gone */
+            std::atomic<bool> enteringS3S4;
+
+            /* the log the raw events are recorded into, -1 when not recording */
+            std::atomic<int> recordFd;
+            pthread_mutex_t recordLock;
+
+            /*
+             * Without threads the events are pushed into a ring that the
+             * host drains, see startPolling. Only the thread calling
+             * process() pushes, only the thread draining pops.
+             */
+            struct PollRing;
+            PollRing *ring = nullptr;
+            bool polling = false;
+
+            void stopListening();
+            void receiveAcpidLine(const char *line, size_t length, uint64_t now);
+            void receiveUdevDevice(const char *action, const char *syspath, uint64_t seqnum, uint64_t now);
+            void record(uint8_t source, uint64_t time, uint64_t seqnum,
+                        const char *first, size_t firstLength, const char *second, size_t secondLength);
+            void handleAcpidLine(const char *line, size_t length, EventTimes times);
+
+            /* an acpi_genl_event of the kernel */
+            struct KernelEvent;
+            void receiveKernelEvent(const KernelEvent &event, uint64_t now);
+            void handleKernelEvent(const KernelEvent &event, EventTimes times);
+
+            /* a key press on an input device */
+            void receiveInputKey(uint16_t code, uint64_t now);
+            void handleInputKey(uint16_t code, EventTimes times);
+
+            /* PrepareForSleep of logind, true before the sleep and false after it */
+            void receiveSleepSignal(bool entering, uint64_t now);
+            void handleSleepSignal(bool entering, EventTimes times);
+            void handleUdevDevice(const char *action, const char *syspath, EventTimes times);
+
+            /* what the hardware said an event was, so a replay does not ask it again */
+            void recordState(ACPIEvent event);
+            bool replayRecord(uint8_t source, const char *payload, size_t length);
+            bool runOnEventThread(ACPITimerCallback &function);
+
+            static void *worker(void*);
+
+            /*
+             * The registered handlers. The table is never modified once
+             * published, adding or removing a handler publishes a copy
+             * and frees the old one once no dispatcher can be using it.
+             */
+            std::atomic<HandlerTable*> ACPIhandlers;
+
+            /*
+             * The dispatchers walking a table, counted by the half of the
+             * epoch they started in. A grace period flips the epoch and
+             * waits for the other half only, new dispatchers don't hold
+             * it up.
+             */
+            std::atomic<unsigned int> epoch;
+            std::atomic<unsigned int> dispatching[2];
+
+            /* serializes the writers of the handler table */
+            pthread_mutex_t registryLock;
+
+            /* serializes the grace periods, taken without the registry lock */
+            pthread_mutex_t graceLock;
+
+            ACPIHandlerId lastHandlerId = 0;
+
+            /*
+             * Events are queued on the handlers they are for, and the
+             * handlers with queued events wait in the ready list for a
+             * worker to pick them up.
+             */
+            pthread_mutex_t dispatchLock;
+            pthread_cond_t workAvailable;
+            pthread_cond_t invocationDone;
+
+            HandlerEntry *readyHead = nullptr;
+            HandlerEntry *readyTail = nullptr;
+
+            ACPIOverflowPolicy overflowPolicy = OVERFLOW_DROP_NEWEST;
+            ACPIQueueCounters queueCounters = {0, 0, 0, 0};
+
+            bool idle(const void *except = nullptr) const;
+
+            /* in microseconds, guarded by the dispatch lock */
+            unsigned int inlineBudget = ACPI_INLINE_BUDGET;
+            ACPIInlinePolicy inlinePolicy = INLINE_WARN;
+
+            pthread_t workers[ACPI_WORKERS];
+            size_t workerCount = 0;
+            bool workersRunning = false;
+
+            /* runs everything that is due later, such as the end of a burst */
+            TimerWheel *timers;
+
+            /*
+             * The filter of every event, in front of the handler queues.
+             * filterLock protects all of them.
+             */
+            FilterState *filters;
+            pthread_mutex_t filterLock;
+
+            /* a dock check is scheduled and will see any further change */
+            std::atomic<bool> dockSettling;
+
+            ACPITimerId addTimer(unsigned int delay, ACPITimerCallback &&callback);
+            void runTimers();
+
+            void filterExpired(ACPIEvent event);
+            void dockSettled();
+
+            /* allocated when the statistics are first enabled, kept until the end */
+            std::atomic<LatencyHistogram*> latency;
+            std::atomic<bool> statsEnabled;
+            pthread_mutex_t statsLock;
+
+            EventTimes receivedNow();
+            void classifiedNow(EventTimes &times);
+            void recordLatency(ACPIEvent event, ACPILatencyStage stage, uint64_t from, uint64_t to);
+
+            /*
+             * What every worker is running, for the watchdog. The
+             * sequence tells apart the invocations a slot has seen.
+             * Guarded by the dispatch lock.
+             */
+            struct Invocation {
+                HandlerEntry *entry;
+                ACPIEvent event;
+                uint64_t started;
+                uint64_t sequence;
+                bool overran;
+            } invocations[ACPI_WORKERS];
+
+            uint64_t invocationSequence = 0;
+            size_t workerSlots = 0;
+
+            /* guarded by the dispatch lock */
+            ACPIOverrunCallback overrunCallback;
+            unsigned int quarantineAfter = 0;
+
+            void watchdogExpired(size_t slot, uint64_t sequence);
+            ACPIOverrun noteOverrun(HandlerEntry *entry, ACPIEvent event, uint64_t elapsed, bool quarantine);
+            void reportOverrun(const ACPIOverrun &overrun);
+            bool setBudget(ACPIEventHandler *handler, ACPIHandlerId id, unsigned int budget);
+
+            /*
+             * The sleep held back until the POWER_S3S4_ENTER handlers are
+             * done, see setPreSleep. Guarded by the dispatch lock.
+             */
+            unsigned int preSleepDeadline = 0;
+            ACPIPreSleepCallback preSleepCallback;
+            bool preSleepActive = false;
+            bool preSleepDispatched = false;
+            unsigned int preSleepPending = 0;
+            uint64_t preSleepStarted = 0;
+            uint64_t preSleepGeneration = 0;
+            ACPITimerId preSleepTimer = 0;
+            vector<ACPIPreSleepTime> preSleepTimes;
+
+            /* the source holding the sleep for this round */
+            EventSource *preSleepSource = nullptr;
+
+            void beginPreSleep(uint64_t now);
+            void preSleepQueued(HandlerEntry *entry);
+            bool preSleepHandled(HandlerEntry *entry, ACPIEvent event, ACPIPreSleepReport &report);
+            bool preSleepDropped(HandlerEntry *entry, unsigned int first, unsigned int count, ACPIPreSleepReport &report);
+            bool finishPreSleep(bool timedOut, ACPIPreSleepReport &report);
+            void preSleepExpired(uint64_t generation);
+            void reportPreSleep(const ACPIPreSleepReport &report);
+
+            /* relaxed atomic counters behind metrics() */
+            Counters *counters;
+
+            /* the periodic metrics file, guarded by metricsLock */
+            pthread_mutex_t metricsLock;
+            string metricsPath;
+            unsigned int metricsInterval = 0;
+            unsigned int metricsGeneration = 0;
+            ACPITimerId metricsTimer = 0;
+
+            void writeMetricsPeriodically(unsigned int generation);
+
+            /* when the dock report that scheduled the pending dock check came in */
+            EventTimes dockTimes;
+
+            void emit(ACPIEvent event, const EventTimes &times);
+            bool deliver(FilterState &state, ACPIEvent event, uint64_t now, EventTimes &times);
+            void dispatch(ACPIEvent event, const EventTimes &times);
+            void runInline(vector<HandlerEntry*> &batch, ACPIEvent event, const EventTimes &times);
+            void makeReady(HandlerEntry *entry);
+            HandlerTable *publish(HandlerTable *table);
+            void synchronize();
+            void releaseEntry(HandlerEntry *entry);
+            void startWorkers();
+            void stopWorkers();
+
+            ACPIHandlerId addEntry(ACPICallback *callback, ACPIEventHandler *handler,
+                                   ACPIEventMask mask, ACPIDispatchMode mode);
+            bool removeEntries(ACPIEventHandler *handler, ACPIHandlerId id);
+
+        public:
+
+            ACPI();
+            ~ACPI();
+
+            /**
+             * @brief Set a custom event handler for ACPI events
+             *
+             * This can be called at any time, also while the listeners
+             * are running and from inside a handler.
+             *
+             * @param handler the handler to add
+             * @param mask the events the handler is called for, all by default
+             * @param mode how the invocations of the handler are scheduled
+             */
+            void addEventHandler(ACPIEventHandler *handler,
+                                 ACPIEventMask mask = ACPIEventMask().set(),
+                                 ACPIDispatchMode mode = DISPATCH_PARALLEL);
+
+            /**
+             * @brief Remove a handler added with addEventHandler
+             *
+             * Once this returns, the handler is not running anymore and
+             * will not be called again, so it can be safely deleted. When
+             * called from inside the handler that is being removed, only
+             * the other invocations of it are waited for.
+             *
+             * @param handler the handler to remove
+             * @return true if the handler was registered
+             */
+            bool removeEventHandler(ACPIEventHandler *handler);
+
+            /**
+             * @brief Add a callable as a handler for ACPI events
+             *
+             * The callable is anything that can be called with an ACPIEvent,
+             * such as a lambda or a std::function. It is called from one of
+             * the ACPI worker threads.
+             *
+             * @param function the callable to add
+             * @param mask the events the callable is called for, all by default
+             * @param mode how the invocations of the callable are scheduled
+             * @return the id to remove the callable with
+             */
+            template<typename F>
+            typename std::enable_if<!std::is_convertible<F, ACPIEventHandler*>::value, ACPIHandlerId>::type
+            addEventHandler(F function,
+                            ACPIEventMask mask = ACPIEventMask().set(),
+                            ACPIDispatchMode mode = DISPATCH_PARALLEL) {
+                return addEntry(new ACPICallback(std::move(function)), nullptr, mask, mode);
+            }
+
+            /**
+             * @brief Remove a callable added with addEventHandler
+             *
+             * This waits for running invocations just like removing an
+             * ACPIEventHandler does.
+             *
+             * @param id the id returned when the callable was added
+             * @return true if the callable was registered
+             */
+            bool removeEventHandler(ACPIHandlerId id);
+
+            /**
+             * @brief Set what happens to events for a handler that can't
+             * keep up, OVERFLOW_DROP_NEWEST by default
+             *
+             * @param policy the policy for all handlers
+             */
+            void setOverflowPolicy(ACPIOverflowPolicy policy);
+
+            /**
+             * @brief Get the counters of the handler event queues
+             * @return a snapshot of the counters
+             */
+            ACPIQueueCounters getQueueCounters();
+
+            /**
+             * @brief Set how long a DISPATCH_INLINE handler may take,
+             * ACPI_INLINE_BUDGET microseconds with INLINE_WARN by default
+             *
+             * Every inline invocation is timed, the policy is applied to
+             * the handler when it returns over the budget.
+             *
+             * @param budget the budget in microseconds
+             * @param policy what to do with a handler over the budget
+             */
+            void setInlineBudget(unsigned int budget, ACPIInlinePolicy policy);
+
+            /**
+             * @brief Give a handler a time budget for handling an event
+             *
+             * The watchdog reports every invocation of the handler that
+             * is still running once the budget is over, see setWatchdog.
+             * Invocations of DISPATCH_INLINE handlers can only be checked
+             * once they returned. The budget is 0 by default, which
+             * leaves the handler unwatched.
+             *
+             * @param handler the handler
+             * @param budget the budget in milliseconds, 0 to unwatch it
+             * @return true if the handler was registered
+             */
+            bool setHandlerBudget(ACPIEventHandler *handler, unsigned int budget);
+
+            /**
+             * @brief Give a callable handler a time budget, see above
+             * @param id the id returned when the callable was added
+             * @param budget the budget in milliseconds, 0 to unwatch it
+             * @return true if the callable was registered
+             */
+            bool setHandlerBudget(ACPIHandlerId id, unsigned int budget);
+
+            /**
+             * @brief Set how the watchdog reports overruns
+             *
+             * Overruns are always printed and counted in the metrics. The
+             * callback is called on the ACPI event thread, so it should
+             * return quickly.
+             *
+             * A handler that overran quarantineAfter times in a row is
+             * quarantined: it gets no new events until the invocations
+             * it is running have finished. An invocation within budget
+             * resets the count.
+             *
+             * @param callback called for every overrun, may be empty
+             * @param quarantineAfter overruns in a row before a handler
+             * is quarantined, 0 to never quarantine
+             */
+            void setWatchdog(ACPIOverrunCallback callback, unsigned int quarantineAfter = 0);
+
+            /**
+             * @brief Enable or disable timing the events, see stats()
+             *
+             * While enabled, every event is timed with CLOCK_MONOTONIC when
+             * it is received, classified, queued, and when a handler starts
+             * and finishes it. Disabled by default.
+             *
+             * @param enabled true to time the events
+             */
+            void enableStats(bool enabled);
+
+            /**
+             * @brief Get the latency histograms of the events timed so far
+             * @return a snapshot of the histograms, all empty if the
+             * statistics were never enabled
+             */
+            ACPIStats stats();
+
+            /**
+             * @brief Get the runtime counters
+             * @return a snapshot of the counters
+             */
+            ACPIMetrics metrics();
+
+            /**
+             * @brief Write the runtime counters and the handler queue
+             * counters to a file in the Prometheus text format
+             *
+             * The file is written next to the path and renamed over it,
+             * so readers like the node-exporter textfile collector never
+             * see a partial file.
+             *
+             * @param path the file to write
+             * @return true if the file was written
+             */
+            bool writeMetrics(const string &path);
+
+            /**
+             * @brief Write the metrics file periodically, see writeMetrics
+             *
+             * The file is written from the ACPI event thread once the
+             * listener is started.
+             *
+             * @param path the file to write
+             * @param interval the interval in milliseconds, 0 to stop writing
+             */
+            void setMetricsFile(const string &path, unsigned int interval);
+
+            /**
+             * @brief Set how an event is debounced and rate limited
+             * before it is handed to the handlers
+             *
+             * This can be called at any time, a burst that is in progress
+             * ends according to the new filter.
+             *
+             * @param event the event to filter
+             * @param filter the filter, all zero to let every event through
+             */
+            void setEventFilter(ACPIEvent event, ACPIEventFilter filter);
+
+            /**
+             * @brief Run a callable once after a delay
+             *
+             * Timers are kept in a timer wheel with a resolution of one
+             * millisecond, scheduling and cancelling them takes constant
+             * time. The callable is run on the ACPI event thread, which
+             * also reads the events, so it should return quickly and hand
+             * longer work off. Timers only run after start().
+             *
+             * @param delay the delay in milliseconds
+             * @param function a callable without arguments
+             * @return the id to cancel the timer with
+             */
+            template<typename F>
+            ACPITimerId scheduleTimer(unsigned int delay, F function) {
+                return addTimer(delay, ACPITimerCallback(std::move(function)));
+            }
+
+            /**
+             * @brief Cancel a timer that did not run yet
+             *
+             * A timer that has already started running is not waited for.
+             *
+             * @param id the id returned when the timer was scheduled
+             * @return true if the timer was cancelled before it ran
+             */
+            bool cancelTimer(ACPITimerId id);
+
+            /**
+             * @brief Record the raw events into a log for replay
+             *
+             * Every acpid line and every udev device the event thread
+             * receives is appended to the log with its monotonic time,
+             * before it is classified. The log is binary and in the byte
+             * order of the host: an 8 byte "TPEVLOG1" magic, then one
+             * record per event, a 16 byte header of the time in
+             * nanoseconds (uint64_t), the length of the payload
+             * (uint16_t), the source (uint8_t, 1 for acpid, 2 for udev, 3
+             * for the kernel, 4 for input devices, 5 for logind and 6 for
+             * a state) and 5 reserved bytes, followed by the payload. The
+             * payload of an acpid record is the line without its newline,
+             * the payload of a udev record is the seqnum (uint64_t)
+             * followed by the action and the syspath, each ending with a
+             * NUL byte, the payload of a kernel record is the struct
+             * acpi_genl_event as the kernel sent it, the payload of an
+             * input record is the key code (uint16_t) and the payload of a
+             * logind record is the argument of PrepareForSleep (uint8_t).
+             * A lid or dock event that was classified by reading the
+             * hardware is followed by a state record, whose payload is the
+             * ACPIEvent (uint8_t) it was classified as. Only the keys that
+             * are hotkeys are recorded, never what is typed.
+             *
+             * Recording into a log that already exists appends to it.
+             *
+             * @param path the log to record into
+             * @return true if the log could be opened
+             */
+            bool startRecording(const string &path);
+
+            /**
+             * @brief Stop recording the raw events
+             */
+            void stopRecording();
+
+            /**
+             * @brief Feed a recorded log through the filters and the handlers
+             *
+             * The events are classified and dispatched as if they had
+             * just been received. The calling thread sleeps between them
+             * to keep the recorded pace divided by speed. A started
+             * instance runs them on the event thread, between the events
+             * that come in, otherwise the calling thread runs them. The
+             * lid and dock events are replayed from their state records,
+             * the hardware is not read. Replayed events are not recorded
+             * again, and filters need the timers of a started instance.
+             *
+             * A polled instance can not replay. Must not be called from a
+             * handler or a timer.
+             *
+             * @param path the log to replay
+             * @param speed 1 for the recorded pace, 2 for twice as fast,
+             * 0 for no pauses at all
+             * @return the number of events replayed, or -1 if the log
+             * could not be read
+             */
+            long replay(const string &path, double speed = 1.0);
+
+            /**
+             * @brief Listen for ACPI events without any library threads
+             *
+             * Instead of start(), for hosts that run their own event loop.
+             * The returned fd becomes readable when there is something to
+             * do, the host then calls process(), which reads the event
+             * sources, runs the due timers and pushes the events into a
+             * ring of ACPI_POLL_RING events that tryPop() and drain() take
+             * them from. Events that do not fit are dropped and counted.
+             *
+             * Handlers may still be added, they are all called from
+             * process() whatever their dispatch mode.
+             *
+             * @return the fd to poll for reading, or -1 on failure
+             */
+            int startPolling();
+
+            /**
+             * @brief Handle whatever made the fd of startPolling readable
+             *
+             * Never blocks. Call it from one thread only.
+             *
+             * @return the number of events waiting in the ring
+             */
+            size_t process();
+
+            /**
+             * @brief Take the oldest event out of the ring
+             * @param event set to the event
+             * @return false if the ring is empty
+             */
+            bool tryPop(ACPIEvent &event);
+
+            /**
+             * @brief Take up to max events out of the ring, oldest first
+             * @param events where to put the events
+             * @param max the room there is in events
+             * @return the number of events taken
+             */
+            size_t drain(ACPIEvent *events, size_t max);
+
+#ifdef LIBTHINKPAD_COROUTINES
+
+            /**
+             * @brief Wait for one ACPI event in a coroutine
+             *
+             * The events are listened for from this call on, so an event
+             * that comes in before the result is awaited is not missed:
+             *
+             *     ACPIEvent event = co_await acpi.next();
+             *
+             * @param mask the events to wait for, all by default
+             * @param executor resumes the coroutine, by default it is
+             * resumed right away on the ACPI worker thread
+             * @return the awaitable, it yields the event
+             */
+            ACPIEventAwaiter next(ACPIEventMask mask = ACPIEventMask().set(),
+                                  ACPIExecutor executor = ACPIExecutor());
+
+#endif
+
+            /**
+             * @brief Take the ACPI events straight from the kernel
+             *
+             * Instead of connecting to acpid, subscribe to the acpi_event
+             * generic netlink group of the kernel and decode its events
+             * without parsing text. The kernel only reports ACPI bus
+             * events there: the power and sleep buttons, the lid, and the
+             * dock through thinkpad_acpi. The keys acpid reports come from
+             * input devices and are not seen this way. The lid state is
+             * read from PROC_ACPI_LID, the event itself does not carry it.
+             *
+             * Must be called before start().
+             *
+             * @param fd a socket that delivers generic netlink messages in
+             * place of the kernel, for testing. The instance takes it
+             * over. -1 to subscribe to the kernel.
+             */
+            void setNetlinkSource(int fd = -1);
+
+            /**
+             * @brief Also take the hotkeys from the input devices
+             *
+             * The volume, mute, brightness and ThinkVantage keys and the
+             * other Fn keys reach the kernel as key presses on the
+             * INPUT_THINKPAD_BUTTONS, INPUT_AT_KEYBOARD and INPUT_VIDEO_BUS
+             * input devices. This reads their event nodes, found through
+             * udev when the instance starts, and turns the key presses into
+             * events, without waiting for acpid. Together with
+             * setNetlinkSource() no event goes through acpid at all. With
+             * acpid the keys acpid reports are seen twice.
+             *
+             * The devices are read, not grabbed, the keys still reach
+             * everything else. Reading the event nodes usually needs root
+             * or the input group.
+             *
+             * Must be called before start().
+             *
+             * @param fd a file that delivers struct input_event records in
+             * place of an input device, for testing. Can be called once
+             * per file, the instance takes them over. -1 to read the
+             * input devices of the system.
+             */
+            void setInputSource(int fd = -1);
+
+            /**
+             * @brief Take the sleep events from logind
+             *
+             * Instead of inferring POWER_S3S4_ENTER and POWER_S3S4_EXIT
+             * from the machinecheck devices every core removes and adds
+             * again, listen for the PrepareForSleep signal of logind. It
+             * comes once before the system sleeps, before the cores go
+             * down, and once after it woke up. The machinecheck devices
+             * are not received at all then.
+             *
+             * The event source keeps one connection to the system bus
+             * for as long as it runs. When the bus is lost it connects
+             * again, backing off like it does for acpid. The bus is the
+             * one sd-bus connects to, DBUS_SYSTEM_BUS_ADDRESS points it
+             * at another one for testing. Needs a build with systemd.
+             *
+             * Must be called before start().
+             */
+            void setLogindSource();
+
+            /**
+             * @brief Hold the sleep back until the POWER_S3S4_ENTER
+             * handlers are done
+             *
+             * With the logind source, the event source takes a delay
+             * inhibitor lock from logind. When logind announces a sleep,
+             * POWER_S3S4_ENTER is given to every subscribed handler at
+             * once. The workers run the handlers side by side, up to
+             * ACPI_WORKERS at a time. The lock is released as soon as
+             * every handler has returned or the deadline has passed,
+             * whichever comes first, and taken again after the resume.
+             * logind itself never waits longer than its
+             * InhibitDelayMaxSec, 5 seconds unless configured otherwise.
+             *
+             * A filter that holds POWER_S3S4_ENTER back holds the sleep
+             * back until the deadline.
+             *
+             * Must be called before start(), implies setLogindSource().
+             *
+             * @param deadline the longest the sleep is held back, in
+             * milliseconds
+             * @param report called after every round with the time each
+             * handler took, on the thread that ended the round, may be
+             * empty
+             */
+            void setPreSleep(unsigned int deadline, ACPIPreSleepCallback report = nullptr);
+
+            /**
+             * @brief Keep the Hardware::HardwareCache current
+             *
+             * The event source reads the dock, the ThinkLight, the
+             * backlight and the batteries when it starts and whenever
+             * udev reports a change of one of them. Their getters are
+             * memory reads for as long as it runs, see the
+             * Hardware::HardwareCache for how current they are.
+             *
+             * Must be called before start().
+             */
+            void setHardwareCache();
+
+            /**
+             * @brief Listen on another acpid socket than ACPID_SOCK
+             *
+             * Meant for testing and benchmarking against a fake acpid.
+             * Must be called before start().
+             *
+             * @param path the path of the socket
+             */
+            void setAcpidSocket(const string &path);
+
+            /**
+             * @brief Block the caller of the method for infinite-loop
+             * exit-prevention, until the instance stops listening.
+             * Used for testing.
+             */
+            void wait();
+
+            /**
+             * @brief Stop listening on ACPI events within a deadline
+             *
+             * No more events come in once this is called. The queued
+             * events are then handled or dropped according to the policy,
+             * and the invocations still running are waited for. When all
+             * of that is done before the deadline, the workers are
+             * stopped and the instance can be started again. Otherwise
+             * the workers keep running the handlers that are left, and a
+             * later stop() or the destructor waits for them.
+             *
+             * The deadline starts once the listener has stopped, which
+             * waits for an inline handler the event thread is running.
+             * Called from a worker handler, the calling invocation is not
+             * waited for and the workers keep running until the next
+             * stop() or the destructor. Must not be called from an inline
+             * handler or a timer.
+             *
+             * @param timeout the deadline in milliseconds
+             * @param policy what to do with the queued events
+             * @return true if every handler finished in time
+             */
+            bool stop(unsigned int timeout, ACPIStopPolicy policy = STOP_DRAIN);
+
+            /**
+             * @brief starts the listening on ACPI events
+             *
+             * All instances of the process listening on the same acpid
+             * socket share one acpid connection, one udev monitor and
+             * one event thread. Every instance still has its own
+             * handlers, filters, timers and workers.
+             */
+            void start();
+        };
+
+
+        /**
+         * @brief This is the abstract ACPI event handler class.
+         *
+         * If you want to use this class, override the handleEvent(ACPIEvent)
+         * method and do your thing there. The method is called from one of the
+         * ACPI worker threads so watch out for threading issues that might occur.
+         * A handler that blocks keeps its worker busy until it returns. Handlers
+         * added with DISPATCH_INLINE are called from the ACPI event thread.
+         *
+         * If you need to
+         * use shared resources inside the handler, use the pthread mutex API.
+         */
+        class ACPIEventHandler {
+        public:
+            /**
+             * This method is called for various ACPI events, such
+             * as power button presses, lid events and dock events.
+             *
+             * @param event the event that occured
+             */
+            virtual void handleEvent(ACPIEvent event) = 0;
+
+            /**
+             * This method is called for events that were coalesced,
+             * see OVERFLOW_COALESCE. By default it calls handleEvent
+             * once, override it to see the repeat count.
+             *
+             * @param event the event that occured
+             * @param repeat how many times the event occured in a row
+             */
+            virtual void handleRepeatedEvent(ACPIEvent event, unsigned int repeat) {
+                (void) repeat;
+                handleEvent(event);
+            }
+        };
+
+#ifdef LIBTHINKPAD_COROUTINES
+
+        /*
+         * What a stream and its handler share. The handler keeps it alive
+         * until its last invocation, even after the stream is gone.
+         */
+        struct ACPIEventChannel {
+
+            pthread_mutex_t lock;
+
+            /* the events nobody waited for yet, the oldest are dropped */
+            std::deque<ACPIEvent> events;
+
+            /* the coroutine waiting and where it wants the event */
+            std::coroutine_handle<> waiter;
+            ACPIEvent *slot = nullptr;
+
+            ACPIExecutor executor;
+
+            ACPIEventChannel() {
+                pthread_mutex_init(&this->lock, NULL);
+            }
+
+            ~ACPIEventChannel() {
+                pthread_mutex_destroy(&this->lock);
+            }
+
+            void push(ACPIEvent event) {
+
+                pthread_mutex_lock(&this->lock);
+
+                if (!this->waiter) {
+
+                    if (this->events.size() == ACPI_HANDLER_QUEUE) {
+                        this->events.pop_front();
+                    }
+
+                    this->events.push_back(event);
+                    pthread_mutex_unlock(&this->lock);
+                    return;
+                }
+
+                std::coroutine_handle<> resumed = this->waiter;
+                this->waiter = nullptr;
+                *this->slot = event;
+
+                pthread_mutex_unlock(&this->lock);
+
+                if (this->executor) {
+                    this->executor(resumed);
+                } else {
+                    resumed.resume();
+                }
+            }
+
+            bool pop(ACPIEvent &event) {
+
+                if (this->events.empty()) {
+                    return false;
+                }
+
+                event = this->events.front();
+                this->events.pop_front();
+
+                return true;
+            }
+        };
+
+        /**
+         * @brief Awaiting it suspends the coroutine until the next ACPI
+         * event, see ACPI::next and ACPIEventStream::next
+         */
+        class ACPIEventAwaiter {
+
+            std::shared_ptr<ACPIEventChannel> channel;
+            ACPIEvent event = ACPIEvent::UNKNOWN;
+
+            /* set when the awaiter listens by itself, see ACPI::next */
+            ACPI *acpi = nullptr;
+            ACPIHandlerId id = 0;
+
+            friend class ACPI;
+            friend class ACPIEventStream;
+
+            explicit ACPIEventAwaiter(std::shared_ptr<ACPIEventChannel> channel) : channel(std::move(channel)) {}
+
+        public:
+
+            ACPIEventAwaiter(ACPIEventAwaiter &&other) noexcept
+                : channel(std::move(other.channel)), event(other.event), acpi(other.acpi), id(other.id) {
+                other.acpi = nullptr;
+            }
+
+            ACPIEventAwaiter(const ACPIEventAwaiter&) = delete;
+            ACPIEventAwaiter &operator=(const ACPIEventAwaiter&) = delete;
+
+            ~ACPIEventAwaiter() {
+                if (this->acpi != nullptr) {
+                    this->acpi->removeEventHandler(this->id);
+                }
+            }
+
+            bool await_ready() {
+                pthread_mutex_lock(&this->channel->lock);
+                const bool ready = this->channel->pop(this->event);
+                pthread_mutex_unlock(&this->channel->lock);
+                return ready;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+
+                pthread_mutex_lock(&this->channel->lock);
+
+                /* an event came in since await_ready */
+                if (this->channel->pop(this->event)) {
+                    pthread_mutex_unlock(&this->channel->lock);
+                    return false;
+                }
+
+                this->channel->waiter = handle;
+                this->channel->slot = &this->event;
+
+                pthread_mutex_unlock(&this->channel->lock);
+
+                return true;
+            }
+
+            ACPIEvent await_resume() const {
+                return this->event;
+            }
+        };
+
+        /**
+         * An asynchronous generator of ACPI events for coroutines. The
+         * stream listens from its creation until it is destroyed and
+         * keeps up to ACPI_HANDLER_QUEUE events nobody waited for yet,
+         * dropping the oldest. Only one coroutine may wait on it at a time.
+         *
+         *     ACPIEventStream events(acpi, mask);
+         *
+         *     for (;;) {
+         *         ACPIEvent event = co_await events.next();
+         *         ...
+         *     }
+         *
+         * @brief A stream of ACPI events to co_await on
+         */
+        class ACPIEventStream {
+
+            ACPI &acpi;
+            std::shared_ptr<ACPIEventChannel> channel;
+            ACPIHandlerId id;
+
+        public:
+
+            /**
+             * @param acpi the instance to listen on
+             * @param mask the events to listen for, all by default
+             * @param executor resumes the waiting coroutine, by default it
+             * is resumed right away on the ACPI worker thread
+             */
+            explicit ACPIEventStream(ACPI &acpi,
+                                     ACPIEventMask mask = ACPIEventMask().set(),
+                                     ACPIExecutor executor = ACPIExecutor())
+                : acpi(acpi), channel(std::make_shared<ACPIEventChannel>()) {
+
+                this->channel->executor = std::move(executor);
+
+                std::shared_ptr<ACPIEventChannel> channel = this->channel;
+
+                /* serial, so the events come out in order */
+                this->id = acpi.addEventHandler([channel](ACPIEvent event) {
+                    channel->push(event);
+                }, mask, DISPATCH_SERIAL);
+            }
+
+            ACPIEventStream(const ACPIEventStream&) = delete;
+            ACPIEventStream &operator=(const ACPIEventStream&) = delete;
+
+            ~ACPIEventStream() {
+                this->acpi.removeEventHandler(this->id);
+            }
+
+            /**
+             * @brief Wait for the next event of the stream
+             * @return the awaitable, it yields the event
+             */
+            ACPIEventAwaiter next() {
+                return ACPIEventAwaiter(this->channel);
+            }
+        };
+
+        inline ACPIEventAwaiter ACPI::next(ACPIEventMask mask, ACPIExecutor executor) {
+
+            std::shared_ptr<ACPIEventChannel> channel = std::make_shared<ACPIEventChannel>();
+            channel->executor = std::move(executor);
+
+            ACPIEventAwaiter awaiter(channel);
+
+            awaiter.acpi = this;
+            awaiter.id = addEventHandler([channel](ACPIEvent event) {
+                channel->push(event);
+            }, mask, DISPATCH_SERIAL);
+
+            return awaiter;
+        }
+
+#endif
+
     }
 
 